@@ -58,7 +58,8 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 }
 
 /**
-* Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
+* Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs,
+* stamping it with the next sequence number.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
 * new start location.
 * Any necessary locking must be handled by the caller
@@ -76,6 +77,7 @@ struct aesd_buffer_entry *aesd_circular_buffer_add_entry(struct aesd_circular_bu
 		buffer->full = true;
 
 	old_entry = buffer->entry[offs];
+	add_entry->seq = buffer->next_seq++;
 	buffer->entry[offs] = add_entry;
 	buffer->in_offs = new_offs;
 	if (buffer->full)
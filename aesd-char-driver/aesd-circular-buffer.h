@@ -16,7 +16,10 @@
 #include <stdbool.h>
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+/* may be overridden by host builds only, e.g. the ring size benchmarks */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,6 +31,11 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Sequence number assigned when the entry was added, monotonically
+     * increasing for the lifetime of the buffer
+     */
+    uint64_t seq;
 };
 
 struct aesd_circular_buffer
@@ -49,6 +57,10 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * The sequence number the next added entry will get
+     */
+    uint64_t next_seq;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -0,0 +1,89 @@
+/**
+ * @file aesd-stats.c
+ * @brief Per-device statistics for the aesdchar driver, exported via debugfs
+ *
+ * Every device gets a <debugfs>/aesdchar/aesdcharN/stats file summing up the
+ * per-CPU counters updated by the file operations in main.c.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "aesdchar.h"
+#include "aesd-stats.h"
+
+static struct dentry *aesd_debugfs_root;
+
+static const char * const aesd_stat_names[AESD_STAT_NR_ITEMS] = {
+	[AESD_STAT_BYTES_WRITTEN]	= "bytes_written",
+	[AESD_STAT_CMDS_WRITTEN]	= "commands_written",
+	[AESD_STAT_BYTES_READ]		= "bytes_read",
+	[AESD_STAT_CMDS_READ]		= "commands_read",
+	[AESD_STAT_EVICTIONS]		= "evictions",
+	[AESD_STAT_PARTIAL_MERGES]	= "partial_write_merges",
+	[AESD_STAT_ALLOC_FAILURES]	= "allocation_failures",
+	[AESD_STAT_LOCK_CONTENDED]	= "lock_contended",
+	[AESD_STAT_LOCK_WAIT_NS]	= "lock_wait_ns",
+};
+
+static int aesd_stats_show(struct seq_file *m, void *v)
+{
+	struct aesd_dev *device = m->private;
+	struct aesd_stats sum;
+	int cpu, i;
+
+	memset(&sum, 0, sizeof sum);
+	for_each_possible_cpu(cpu) {
+		struct aesd_stats *stats = per_cpu_ptr(device->stats, cpu);
+
+		for (i = 0; i < AESD_STAT_NR_ITEMS; i++)
+			sum.item[i] += READ_ONCE(stats->item[i]);
+		for (i = 0; i < AESD_STAT_SIZE_BUCKETS; i++)
+			sum.size_hist[i] += READ_ONCE(stats->size_hist[i]);
+	}
+
+	for (i = 0; i < AESD_STAT_NR_ITEMS; i++)
+		seq_printf(m, "%s: %llu\n", aesd_stat_names[i], sum.item[i]);
+
+	seq_puts(m, "entry_size_histogram:\n");
+	for (i = 0; i < AESD_STAT_SIZE_BUCKETS - 1; i++)
+		seq_printf(m, "  %lu-%lu: %llu\n", 1UL << i, (2UL << i) - 1, sum.size_hist[i]);
+	seq_printf(m, "  %lu+: %llu\n", 1UL << i, sum.size_hist[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+int aesd_stats_init(struct aesd_dev *device, int index)
+{
+	char name[16];
+
+	device->stats = alloc_percpu(struct aesd_stats);
+	if (!device->stats)
+		return -ENOMEM;
+
+	/* debugfs is best effort, the driver works the same without it */
+	snprintf(name, sizeof name, "aesdchar%d", index);
+	device->debugfs = debugfs_create_dir(name, aesd_debugfs_root);
+	debugfs_create_file("stats", 0444, device->debugfs, device, &aesd_stats_fops);
+
+	return 0;
+}
+
+void aesd_stats_destroy(struct aesd_dev *device)
+{
+	debugfs_remove_recursive(device->debugfs);
+	free_percpu(device->stats);
+}
+
+void aesd_stats_debugfs_init(void)
+{
+	aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+}
+
+void aesd_stats_debugfs_exit(void)
+{
+	debugfs_remove_recursive(aesd_debugfs_root);
+}
@@ -0,0 +1,63 @@
+/*
+ * aesd-stats.h
+ *
+ *  @brief Per-device statistics for the aesdchar driver, exported via debugfs
+ */
+
+#ifndef AESD_STATS_H
+#define AESD_STATS_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+
+enum aesd_stat_item {
+	AESD_STAT_BYTES_WRITTEN,
+	AESD_STAT_CMDS_WRITTEN,
+	AESD_STAT_BYTES_READ,
+	AESD_STAT_CMDS_READ,		/* reads reaching the end of a command */
+	AESD_STAT_EVICTIONS,
+	AESD_STAT_PARTIAL_MERGES,	/* writes appended to a partial command */
+	AESD_STAT_ALLOC_FAILURES,
+	AESD_STAT_LOCK_CONTENDED,	/* device lock acquisitions failing trylock */
+	AESD_STAT_LOCK_WAIT_NS,		/* time spent waiting for the device lock */
+	AESD_STAT_NR_ITEMS
+};
+
+/*
+ * Committed entry sizes are accounted in power of two buckets: bucket n
+ * counts sizes in [2^n, 2^(n+1)), the last one everything larger.
+ */
+#define AESD_STAT_SIZE_BUCKETS 16
+
+/*
+ * Counters are kept per CPU, so updating them from aesd_read()/aesd_write()
+ * never bounces a shared cache line; they are only summed up when read.
+ */
+struct aesd_stats
+{
+	u64 item[AESD_STAT_NR_ITEMS];
+	u64 size_hist[AESD_STAT_SIZE_BUCKETS];
+};
+
+struct aesd_dev;
+
+static inline unsigned int aesd_stat_size_bucket(size_t size)
+{
+	unsigned int bucket = size ? ilog2(size) : 0;
+
+	return min_t(unsigned int, bucket, AESD_STAT_SIZE_BUCKETS - 1);
+}
+
+#define aesd_stat_add(device, stat, n)	this_cpu_add((device)->stats->item[stat], n)
+#define aesd_stat_inc(device, stat)	this_cpu_inc((device)->stats->item[stat])
+#define aesd_stat_entry_size(device, size) \
+	this_cpu_inc((device)->stats->size_hist[aesd_stat_size_bucket(size)])
+
+extern int aesd_stats_init(struct aesd_dev *device, int index);
+extern void aesd_stats_destroy(struct aesd_dev *device);
+extern void aesd_stats_debugfs_init(void);
+extern void aesd_stats_debugfs_exit(void);
+
+#endif /* AESD_STATS_H */
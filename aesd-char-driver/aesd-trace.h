@@ -0,0 +1,136 @@
+/*
+ * aesd-trace.h
+ *
+ *  @brief Tracepoints for the aesdchar driver, available under
+ *         /sys/kernel/tracing/events/aesdchar/ for ftrace and perf
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/kdev_t.h>
+#include "aesdchar.h"
+
+/*
+ * lock_wait_ns is how long the caller slept on the device lock before the
+ * event fired, 0 when the lock was taken uncontended.
+ */
+TRACE_EVENT(aesd_write_enter,
+	TP_PROTO(struct aesd_dev *device, size_t count, size_t pending),
+	TP_ARGS(device, count, pending),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, count)
+		__field(size_t, pending)
+		__field(u64, lock_wait_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(device->cdev.dev);
+		__entry->count = count;
+		__entry->pending = pending;
+		__entry->lock_wait_ns = device->lock_wait_ns;
+	),
+	TP_printk("minor=%u count=%zu pending=%zu lock_wait_ns=%llu",
+		  __entry->minor, __entry->count, __entry->pending,
+		  __entry->lock_wait_ns)
+);
+
+DECLARE_EVENT_CLASS(aesd_entry_class,
+	TP_PROTO(struct aesd_dev *device, struct aesd_buffer_entry *entry, loff_t offset),
+	TP_ARGS(device, entry, offset),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u64, seq)
+		__field(size_t, size)
+		__field(loff_t, offset)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(device->cdev.dev);
+		__entry->seq = entry->seq;
+		__entry->size = entry->size;
+		__entry->offset = offset;
+	),
+	TP_printk("minor=%u seq=%llu size=%zu offset=%lld",
+		  __entry->minor, __entry->seq, __entry->size, __entry->offset)
+);
+
+/* offset is the absolute stream offset where the committed entry starts */
+DEFINE_EVENT(aesd_entry_class, aesd_write_commit,
+	TP_PROTO(struct aesd_dev *device, struct aesd_buffer_entry *entry, loff_t offset),
+	TP_ARGS(device, entry, offset)
+);
+
+/* offset is the absolute stream offset where the evicted entry started */
+DEFINE_EVENT(aesd_entry_class, aesd_write_evict,
+	TP_PROTO(struct aesd_dev *device, struct aesd_buffer_entry *entry, loff_t offset),
+	TP_ARGS(device, entry, offset)
+);
+
+TRACE_EVENT(aesd_read,
+	TP_PROTO(struct aesd_dev *device, loff_t pos, size_t count,
+		 struct aesd_buffer_entry *entry, size_t byte, ssize_t ret),
+	TP_ARGS(device, pos, count, entry, byte, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(s64, seq)
+		__field(size_t, byte)
+		__field(ssize_t, ret)
+		__field(u64, lock_wait_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(device->cdev.dev);
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->seq = entry ? (s64)entry->seq : -1;
+		__entry->byte = byte;
+		__entry->ret = ret;
+		__entry->lock_wait_ns = device->lock_wait_ns;
+	),
+	TP_printk("minor=%u pos=%lld count=%zu seq=%lld byte=%zu ret=%zd lock_wait_ns=%llu",
+		  __entry->minor, __entry->pos, __entry->count, __entry->seq,
+		  __entry->byte, __entry->ret, __entry->lock_wait_ns)
+);
+
+/*
+ * pos is the file offset a seek ioctl moved to, and index the entry it landed
+ * in counting from the oldest one held, both -1 when the ioctl did not seek.
+ */
+TRACE_EVENT(aesd_ioctl,
+	TP_PROTO(struct aesd_dev *device, unsigned int cmd, long ret,
+		 struct aesd_ioctl_trace *trace),
+	TP_ARGS(device, cmd, ret, trace),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+		__field(loff_t, pos)
+		__field(int, index)
+		__field(u64, lock_wait_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(device->cdev.dev);
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+		__entry->pos = trace->pos;
+		__entry->index = trace->index;
+		__entry->lock_wait_ns = trace->lock_wait_ns;
+	),
+	TP_printk("minor=%u cmd=%#x ret=%ld pos=%lld index=%d lock_wait_ns=%llu",
+		  __entry->minor, __entry->cmd, __entry->ret, __entry->pos,
+		  __entry->index, __entry->lock_wait_ns)
+);
+
+#endif /* AESD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd-trace
+#include <trace/define_trace.h>
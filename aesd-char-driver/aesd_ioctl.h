@@ -33,14 +33,132 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Upper bound of commands described by struct aesd_index, matching the
+ * number of write commands the driver keeps around
+ */
+#define AESD_INDEX_MAX_ENTRIES 10
+
+/**
+ * Location of a single command held by the driver
+ */
+struct aesd_index_entry {
+    /**
+     * The zero referenced file offset of the first byte of the command, as
+     * taken by pread() or lseek(); add aesd_index.start to get its absolute
+     * offset in the stream of everything ever written to the device
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes in the command, including its trailing newline
+     */
+    uint64_t size;
+    /**
+     * Sequence number of the command, see AESDCHAR_IOCSEEKTOSEQ
+     */
+    uint64_t seq;
+};
+
+/**
+ * A structure filled in by the driver describing every command it currently
+ * holds, oldest first, so clients can plan reads without scanning the device
+ */
+struct aesd_index {
+    /**
+     * Number of valid elements in entry[]
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * Absolute stream offset of file offset 0
+     */
+    uint64_t start;
+    /**
+     * Total number of bytes readable from the device
+     */
+    uint64_t size;
+    struct aesd_index_entry entry[AESD_INDEX_MAX_ENTRIES];
+};
+
+/**
+ * A structure to be passed by IOCTL from user space to kernel space, asking to
+ * seek to the start of the command stamped with a given sequence number.
+ * Every command written to the device gets the next number of a 64-bit counter,
+ * so unlike aesd_seekto.write_cmd its meaning does not shift with evictions.
+ */
+struct aesd_seekto_seq {
+    /**
+     * Sequence number of the command to seek to. Seeking to the number the
+     * next command will get positions at the end of data.
+     */
+    uint64_t seq;
+    /**
+     * Set by the driver: sequence number of the oldest command still held
+     */
+    uint64_t oldest;
+    /**
+     * Set by the driver: sequence number the next command will get
+     */
+    uint64_t next;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Switch follow mode on (non-zero) or off for the calling file descriptor.
+ * In follow mode a blocking read at the end of data sleeps until a new command
+ * is written, instead of returning 0, and O_NONBLOCK readers get -EAGAIN.
+ * The file offset keeps pointing at the same byte as older commands get
+ * evicted, so a follower reads every command once, unless it falls behind
+ * the oldest one still held.
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Fill in a struct aesd_index describing the commands currently held
+ */
+#define AESDCHAR_IOCGETINDEX _IOR(AESD_IOC_MAGIC, 3, struct aesd_index)
+/**
+ * Seek to a command by sequence number. Fails with ENOENT when the command has
+ * already been evicted, with oldest and next filled in so the caller can tell
+ * how much it missed and resume from oldest.
+ */
+#define AESDCHAR_IOCSEEKTOSEQ _IOWR(AESD_IOC_MAGIC, 4, struct aesd_seekto_seq)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
+
+/**
+ * Layout of the first page of a read-only mmap() of an aesd char device.
+ *
+ * The data ring starts at @data_offset bytes into the mapping and holds the
+ * most recent @capacity bytes written to the device: the byte at absolute
+ * stream offset x lives at data_offset + (x % capacity). The visible history
+ * is [start, start + length), which may be shorter than what read() returns
+ * when the device holds more than @capacity bytes.
+ *
+ * @generation works as a sequence count: it is odd while the driver is
+ * updating the mapping. A reader samples it (retrying while odd), copies
+ * what it needs, then samples it again and retries the whole view if the
+ * value changed, as the ring may have wrapped over the bytes it just read.
+ *
+ * Map the first page to learn @data_offset and @capacity, then map
+ * data_offset + capacity bytes to get the whole view.
+ */
+struct aesd_mmap_header {
+    uint32_t generation;
+    uint32_t data_offset;
+    uint64_t capacity;
+    uint64_t start;
+    uint64_t length;
+};
+
+/**
+ * Size of the data ring exposed through mmap(), must be a power of two
+ */
+#define AESD_MMAP_DATA_SIZE (64 * 1024)
 
 #endif /* AESD_IOCTL_H */
@@ -25,22 +25,73 @@
 
 #include "aesd-circular-buffer.h"
 
+struct aesd_pending
+{
+	char *buffptr;		/* partial command, no '\n' seen yet */
+	size_t size;		/* bytes held in buffptr */
+	size_t capacity;	/* bytes allocated for buffptr */
+};
+
+/*
+ * Where the last read of a file ended up in the circular buffer, so the next
+ * one continuing from there does not walk the ring from out_offs again.
+ * Only trusted while generation matches the device's ring_gen.
+ */
+struct aesd_read_cursor
+{
+	u64 generation;
+	loff_t start;		/* stream offset of the entry at index */
+	uint8_t index;
+};
+
 struct aesd_dev
 {
 	struct mutex lock;
 	struct aesd_circular_buffer queue;
+	loff_t start;		/* stream offset of the oldest byte held in queue */
+	loff_t end;		/* stream offset one past the newest byte in queue */
+	u64 ring_gen;		/* bumped whenever entries leave queue */
+	struct aesd_mmap_header *map;	/* read-only view exported by mmap */
+	wait_queue_head_t waitq;	/* readers waiting for new commands */
+	struct aesd_pending pending;	/* left behind by released files */
+	u64 lock_wait_ns;	/* time the lock holder slept waiting for lock */
+	struct aesd_stats __percpu *stats;
+	struct dentry *debugfs;
 	struct cdev cdev;	/* Char device structure      */
 };
 
+/*
+ * What an ioctl did under the device lock, for its tracepoint: fired once the
+ * lock is gone, it cannot read device->lock_wait_ns of a later holder.
+ */
+struct aesd_ioctl_trace
+{
+	u64 lock_wait_ns;
+	loff_t pos;		/* resulting file offset, -1 if not moved */
+	int index;		/* entry seeked to, from the oldest held; -1 if none */
+};
+
+struct aesd_file
+{
+	struct aesd_dev *device;
+	bool follow;		/* block at end of data until new commands arrive */
+	loff_t base;		/* device->start when the file offset was last set */
+	struct aesd_pending pending;	/* this file's partial command */
+	struct aesd_read_cursor cursor;
+};
+
 
 void aesd_cleanup_module(void);
 int aesd_init_module(void);
-static int aesd_setup_cdev(struct aesd_dev *dev);
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from);
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
 int aesd_release(struct inode *inode, struct file *filp);
 int aesd_open(struct inode *inode, struct file *filp);
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence);
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait);
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,259 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Host-side microbenchmarks for the aesd circular buffer
+ *
+ * Measures aesd_circular_buffer_add_entry() and
+ * aesd_circular_buffer_find_entry_offset_for_fpos() for a few entry size
+ * distributions and access patterns, reporting ns/op and allocations/op.
+ * The ring size is fixed at build time through
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, so the build produces one binary
+ * per ring size.
+ *
+ * Usage: aesd-circular-buffer-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../aesd-circular-buffer.h"
+
+#define DEFAULT_ITERATIONS	1000000UL
+#define ARRAY_SIZE(a)		((int)(sizeof (a) / sizeof (__typeof__(a[0]))))
+
+enum size_dist { DIST_SMALL, DIST_LARGE, DIST_UNIFORM, DIST_BIMODAL };
+
+static const char *dist_names[] = {
+	[DIST_SMALL]	= "fixed-16",
+	[DIST_LARGE]	= "fixed-4096",
+	[DIST_UNIFORM]	= "uniform-1-1024",
+	[DIST_BIMODAL]	= "bimodal-32/4096",
+};
+
+enum access_pattern { ACCESS_SEQUENTIAL, ACCESS_RANDOM, ACCESS_TAIL };
+
+static const char *pattern_names[] = {
+	[ACCESS_SEQUENTIAL]	= "sequential",
+	[ACCESS_RANDOM]		= "random",
+	[ACCESS_TAIL]		= "tail",
+};
+
+static unsigned long allocations;
+static volatile size_t sink;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next(void)
+{
+	/* xorshift64, cheap enough not to skew the timings */
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static void *bench_malloc(size_t size)
+{
+	void *ptr = malloc(size);
+
+	if (!ptr) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	allocations++;
+
+	return ptr;
+}
+
+static size_t entry_size(enum size_dist dist)
+{
+	switch (dist) {
+	case DIST_SMALL:
+		return 16;
+	case DIST_LARGE:
+		return 4096;
+	case DIST_UNIFORM:
+		return 1 + rng_next() % 1024;
+	case DIST_BIMODAL:
+		return (rng_next() % 10) ? 32 : 4096;
+	}
+
+	return 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *op, const char *dist, const char *pattern,
+		   unsigned long iterations, uint64_t elapsed, unsigned long allocs)
+{
+	printf("%-10s ring=%-4d %-16s %-11s %10.2f ns/op %6.2f allocs/op\n",
+	       op, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, dist, pattern,
+	       (double)elapsed / iterations, (double)allocs / iterations);
+}
+
+static struct aesd_buffer_entry *new_entry(size_t size)
+{
+	struct aesd_buffer_entry *entry = bench_malloc(sizeof *entry);
+	char *buff = bench_malloc(size);
+
+	memset(buff, 'x', size);
+	buff[size - 1] = '\n';
+	entry->buffptr = buff;
+	entry->size = size;
+
+	return entry;
+}
+
+static void free_entry(struct aesd_buffer_entry *entry)
+{
+	free((void *)entry->buffptr);
+	free(entry);
+}
+
+static void drain(struct aesd_circular_buffer *buffer)
+{
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+		if (buffer->entry[i])
+			free_entry(buffer->entry[i]);
+	}
+	aesd_circular_buffer_init(buffer);
+}
+
+/*
+ * Steady state insertion into a full ring, allocating and releasing entries
+ * the way the driver does for every command written.
+ */
+static void bench_add(enum size_dist dist, unsigned long iterations)
+{
+	struct aesd_circular_buffer buffer;
+	unsigned long allocs;
+	uint64_t start;
+
+	aesd_circular_buffer_init(&buffer);
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+		aesd_circular_buffer_add_entry(&buffer, new_entry(entry_size(dist)));
+
+	allocs = allocations;
+	start = now_ns();
+	for (unsigned long i = 0; i < iterations; i++) {
+		struct aesd_buffer_entry *old;
+
+		old = aesd_circular_buffer_add_entry(&buffer, new_entry(entry_size(dist)));
+		if (old)
+			free_entry(old);
+	}
+	report("add", dist_names[dist], "-", iterations, now_ns() - start,
+	       allocations - allocs);
+
+	drain(&buffer);
+}
+
+/*
+ * Same as above but recycling a preallocated pool of entries, isolating the
+ * cost of the ring bookkeeping itself.
+ */
+static void bench_add_pooled(unsigned long iterations)
+{
+	struct aesd_buffer_entry pool[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1];
+	struct aesd_circular_buffer buffer;
+	struct aesd_buffer_entry *next = &pool[0];
+	unsigned long allocs;
+	uint64_t start;
+
+	memset(pool, 0, sizeof pool);
+	aesd_circular_buffer_init(&buffer);
+
+	allocs = allocations;
+	start = now_ns();
+	for (unsigned long i = 0; i < iterations; i++) {
+		struct aesd_buffer_entry *old;
+
+		old = aesd_circular_buffer_add_entry(&buffer, next);
+		next = old ? old : &pool[(i + 1) % ARRAY_SIZE(pool)];
+	}
+	report("add-pooled", "-", "-", iterations, now_ns() - start,
+	       allocations - allocs);
+}
+
+static void bench_find(enum size_dist dist, enum access_pattern pattern,
+		       unsigned long iterations)
+{
+	struct aesd_circular_buffer buffer;
+	size_t total = 0, last = 0, fpos = 0;
+	unsigned long allocs;
+	uint64_t start;
+
+	aesd_circular_buffer_init(&buffer);
+	/* wrap around at least once, so out_offs is not trivially zero */
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++) {
+		struct aesd_buffer_entry *old;
+
+		old = aesd_circular_buffer_add_entry(&buffer, new_entry(entry_size(dist)));
+		if (old)
+			free_entry(old);
+	}
+
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+		total += buffer.entry[i]->size;
+	last = buffer.entry[(buffer.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1) %
+			    AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]->size;
+
+	allocs = allocations;
+	start = now_ns();
+	for (unsigned long i = 0; i < iterations; i++) {
+		struct aesd_buffer_entry *entry;
+		size_t byte = 0;
+
+		switch (pattern) {
+		case ACCESS_SEQUENTIAL:
+			/* a reader draining the device 64 bytes at a time */
+			fpos = (fpos + 64) % total;
+			break;
+		case ACCESS_RANDOM:
+			fpos = rng_next() % total;
+			break;
+		case ACCESS_TAIL:
+			fpos = total - 1 - rng_next() % last;
+			break;
+		}
+
+		entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &byte);
+		sink += byte + (entry ? entry->size : 0);
+	}
+	report("find", dist_names[dist], pattern_names[pattern], iterations,
+	       now_ns() - start, allocations - allocs);
+
+	drain(&buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = DEFAULT_ITERATIONS;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+
+	if (!iterations) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int d = 0; d < ARRAY_SIZE(dist_names); d++)
+		bench_add(d, iterations);
+
+	bench_add_pooled(iterations);
+
+	for (int d = 0; d < ARRAY_SIZE(dist_names); d++) {
+		for (int p = 0; p < ARRAY_SIZE(pattern_names); p++)
+			bench_find(d, p, iterations);
+	}
+
+	return EXIT_SUCCESS;
+}
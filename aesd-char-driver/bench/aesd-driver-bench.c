@@ -0,0 +1,316 @@
+/**
+ * @file aesd-driver-bench.c
+ * @brief Multi-threaded host benchmark of the aesdchar file operations
+ *
+ * Builds main.c against the user-space kernel stand-ins in uspace/ and drives
+ * aesd_write(), aesd_read(), aesd_llseek() and AESDCHAR_IOCSEEKTO from many
+ * threads at once, each through its own open file, with a configurable mix of
+ * operations. Reports throughput and mean latency per operation type, how
+ * often the device lock was contended, and the driver's own debugfs stats.
+ *
+ * Usage: aesd-driver-bench [-t threads[,threads...]] [-n ops] [-d devices]
+ *                          [-m write%,read%,seek%] [-q] [-v]
+ *
+ * With -q reads continue where the previous one ended, wrapping around at
+ * the end of data, instead of starting at a random position.
+ */
+
+#include "uspace/uspace-kernel.h"
+#include <unistd.h>
+
+#include "../aesdchar.h"
+#include "../aesd_ioctl.h"
+#include "../aesd-stats.h"
+
+#define DEFAULT_OPS		200000UL
+#define MAX_THREADS		256
+#define READ_SIZE		128
+#define MIN_WRITE		16
+#define MAX_WRITE		256
+
+extern int aesd_nr_devs;
+extern struct aesd_dev *aesd_devices;
+
+enum bench_op { OP_WRITE, OP_READ, OP_SEEK, OP_NR };
+
+static const char *op_names[OP_NR] = {
+	[OP_WRITE]	= "write",
+	[OP_READ]	= "read",
+	[OP_SEEK]	= "seek",
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct aesd_dev *device;
+	unsigned long ops;
+	uint64_t rng;
+	unsigned long count[OP_NR];
+	unsigned long errors[OP_NR];
+	uint64_t ns[OP_NR];
+};
+
+static unsigned int mix[OP_NR] = { 20, 70, 10 };
+static bool sequential;
+static pthread_barrier_t start_barrier;
+
+static uint64_t rng_next(uint64_t *state)
+{
+	/* xorshift64, cheap enough not to skew the timings */
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static enum bench_op pick_op(uint64_t *rng)
+{
+	unsigned int roll = rng_next(rng) % 100;
+
+	if (roll < mix[OP_WRITE])
+		return OP_WRITE;
+	if (roll < mix[OP_WRITE] + mix[OP_READ])
+		return OP_READ;
+	return OP_SEEK;
+}
+
+static long do_write(struct file *filp, uint64_t *rng, char *buf)
+{
+	size_t len = MIN_WRITE + rng_next(rng) % (MAX_WRITE - MIN_WRITE + 1);
+	loff_t pos = filp->f_pos;
+
+	memset(buf, 'a' + rng_next(rng) % 26, len - 1);
+	buf[len - 1] = '\n';
+	return aesd_write(filp, buf, len, &pos);
+}
+
+/* read a chunk from a random position, as a reader seeking around would */
+static long do_read(struct file *filp, uint64_t *rng, char *buf)
+{
+	loff_t pos = filp->f_pos;
+	loff_t size;
+	long ret;
+
+	if (sequential) {
+		ret = aesd_read(filp, buf, READ_SIZE, &filp->f_pos);
+		if (ret || !pos)
+			return ret;
+		/* end of data, start over from the oldest command */
+		if (aesd_llseek(filp, 0, SEEK_SET) < 0)
+			return -EINVAL;
+		return aesd_read(filp, buf, READ_SIZE, &filp->f_pos);
+	}
+
+	size = aesd_llseek(filp, 0, SEEK_END);
+	if (size < 0)
+		return size;
+	pos = size ? rng_next(rng) % size : 0;
+	if (aesd_llseek(filp, pos, SEEK_SET) < 0)
+		return -EINVAL;
+	return aesd_read(filp, buf, READ_SIZE, &filp->f_pos);
+}
+
+static long do_seek(struct file *filp, uint64_t *rng)
+{
+	struct aesd_seekto seekto = {
+		.write_cmd = rng_next(rng) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+		.write_cmd_offset = 0,
+	};
+
+	return aesd_ioctl(filp, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto);
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct inode inode = { .i_cdev = &t->device->cdev };
+	struct file filp = { 0 };
+	char buf[MAX_WRITE];
+
+	if (aesd_open(&inode, &filp)) {
+		fprintf(stderr, "aesd_open failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	for (unsigned long i = 0; i < t->ops; i++) {
+		enum bench_op op = pick_op(&t->rng);
+		uint64_t start = now_ns();
+		long ret;
+
+		switch (op) {
+		case OP_WRITE:
+			ret = do_write(&filp, &t->rng, buf);
+			break;
+		case OP_READ:
+			ret = do_read(&filp, &t->rng, buf);
+			break;
+		default:
+			ret = do_seek(&filp, &t->rng);
+			break;
+		}
+		t->ns[op] += now_ns() - start;
+		t->count[op]++;
+		/* seeking to a command not yet written is expected to fail */
+		if (ret < 0 && op != OP_SEEK)
+			t->errors[op]++;
+	}
+
+	aesd_release(&inode, &filp);
+	return NULL;
+}
+
+static int run(unsigned int nthreads, unsigned long ops, int ndevs, bool verbose)
+{
+	struct bench_thread *threads;
+	unsigned long count[OP_NR] = { 0 }, errors[OP_NR] = { 0 };
+	uint64_t ns[OP_NR] = { 0 }, start, elapsed;
+	char path[64];
+	int ret;
+
+	aesd_nr_devs = ndevs;
+	ret = aesd_init_module();
+	if (ret) {
+		fprintf(stderr, "aesd_init_module: %d\n", ret);
+		return ret;
+	}
+
+	threads = calloc(nthreads, sizeof *threads);
+	if (!threads) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (unsigned int i = 0; i < nthreads; i++) {
+		threads[i].device = &aesd_devices[i % ndevs];
+		threads[i].ops = ops;
+		threads[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+		if (pthread_create(&threads[i].thread, NULL, bench_worker, &threads[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	for (unsigned int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		for (int op = 0; op < OP_NR; op++) {
+			count[op] += threads[i].count[op];
+			errors[op] += threads[i].errors[op];
+			ns[op] += threads[i].ns[op];
+		}
+	}
+	elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	printf("threads=%u devices=%d ops/thread=%lu mix=%u/%u/%u reads=%s elapsed=%.3fs total=%.0f ops/s\n",
+	       nthreads, ndevs, ops, mix[OP_WRITE], mix[OP_READ], mix[OP_SEEK],
+	       sequential ? "sequential" : "random",
+	       elapsed / 1e9, (double)nthreads * ops / (elapsed / 1e9));
+	for (int op = 0; op < OP_NR; op++) {
+		if (!count[op])
+			continue;
+		printf("  %-6s %10lu ops %12.0f ops/s %10.1f ns/op %8lu errors\n",
+		       op_names[op], count[op], count[op] / (elapsed / 1e9),
+		       (double)ns[op] / count[op], errors[op]);
+	}
+	for (int i = 0; i < ndevs; i++) {
+		unsigned long long contended = 0, wait_ns = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct aesd_stats *stats = per_cpu_ptr(aesd_devices[i].stats, cpu);
+
+			contended += stats->item[AESD_STAT_LOCK_CONTENDED];
+			wait_ns += stats->item[AESD_STAT_LOCK_WAIT_NS];
+		}
+		printf("  aesdchar%d lock_contended=%llu (%.2f%% of all ops) lock_wait=%.3fms\n",
+		       i, contended, 100.0 * contended / ((double)nthreads * ops), wait_ns / 1e6);
+		if (verbose) {
+			snprintf(path, sizeof path, "aesdchar/aesdchar%d/stats", i);
+			uspace_debugfs_show(path, stdout);
+		}
+	}
+
+	free(threads);
+	aesd_cleanup_module();
+	return 0;
+}
+
+static int parse_mix(const char *arg)
+{
+	unsigned int w, r, s;
+
+	if (sscanf(arg, "%u,%u,%u", &w, &r, &s) != 3 || w + r + s != 100)
+		return -1;
+	mix[OP_WRITE] = w;
+	mix[OP_READ] = r;
+	mix[OP_SEEK] = s;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t threads[,threads...]] [-n ops] [-d devices] "
+		"[-m write%%,read%%,seek%%] [-q] [-v]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int nthreads[16] = { 1, 2, 4, 8 };
+	int nruns = 4, ndevs = 1, opt;
+	unsigned long ops = DEFAULT_OPS;
+	bool verbose = false;
+	char *tok, *save;
+
+	while ((opt = getopt(argc, argv, "t:n:d:m:qv")) != -1) {
+		switch (opt) {
+		case 't':
+			nruns = 0;
+			for (tok = strtok_r(optarg, ",", &save); tok && nruns < 16;
+			     tok = strtok_r(NULL, ",", &save)) {
+				nthreads[nruns] = strtoul(tok, NULL, 0);
+				if (!nthreads[nruns] || nthreads[nruns] > MAX_THREADS)
+					usage(argv[0]);
+				nruns++;
+			}
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			ndevs = atoi(optarg);
+			break;
+		case 'm':
+			if (parse_mix(optarg))
+				usage(argv[0]);
+			break;
+		case 'q':
+			sequential = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!nruns || !ops || ndevs < 1)
+		usage(argv[0]);
+
+	for (int i = 0; i < nruns; i++) {
+		if (run(nthreads[i], ops, ndevs, verbose))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file aesd-follow-test.c
+ * @brief Host test of the aesdchar follow mode across evictions
+ *
+ * Builds main.c against the user-space kernel stand-ins in uspace/, fills the
+ * ring, drains it through a non-blocking follower and then keeps writing, so
+ * that every new command evicts an old one between two reads. The follower
+ * must get each new command whole, and poll must report it pending.
+ */
+
+#include "uspace/uspace-kernel.h"
+
+#include "../aesdchar.h"
+#include "../aesd_ioctl.h"
+
+extern struct aesd_dev *aesd_devices;
+
+static int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);	\
+		fprintf(stderr, __VA_ARGS__);				\
+		fputc('\n', stderr);					\
+		failures++;						\
+	}								\
+} while (0)
+
+static void write_cmd(struct file *filp, const char *cmd)
+{
+	loff_t pos = 0;
+	ssize_t ret = aesd_write(filp, cmd, strlen(cmd), &pos);
+
+	CHECK(ret == (ssize_t)strlen(cmd), "write \"%s\" returned %zd", cmd, ret);
+}
+
+/* read whatever the follower has pending, up to the end of data */
+static size_t drain(struct file *filp, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t ret;
+
+	while ((ret = aesd_read(filp, buf + len, size - len, &filp->f_pos)) > 0)
+		len += ret;
+
+	CHECK(ret == -EAGAIN, "read at end of data returned %zd, not -EAGAIN", ret);
+	buf[len] = '\0';
+	return len;
+}
+
+static void expect_follow(struct file *writer, struct file *follower, const char *cmd)
+{
+	char buf[256];
+
+	CHECK(!(aesd_poll(follower, NULL) & EPOLLIN), "poll reports data before \"%s\"", cmd);
+	write_cmd(writer, cmd);
+	CHECK(aesd_poll(follower, NULL) & EPOLLIN, "poll misses \"%s\"", cmd);
+	drain(follower, buf, sizeof buf - 1);
+	CHECK(!strcmp(buf, cmd), "follower read \"%s\" instead of \"%s\"", buf, cmd);
+}
+
+int main(void)
+{
+	struct inode inode;
+	struct file writer = { 0 }, follower = { .f_flags = O_NONBLOCK };
+	uint32_t follow = 1;
+	char buf[1024];
+	size_t len;
+
+	if (aesd_init_module()) {
+		fprintf(stderr, "aesd_init_module failed\n");
+		return EXIT_FAILURE;
+	}
+
+	inode.i_cdev = &aesd_devices[0].cdev;
+	if (aesd_open(&inode, &writer) || aesd_open(&inode, &follower)) {
+		fprintf(stderr, "aesd_open failed\n");
+		return EXIT_FAILURE;
+	}
+
+	CHECK(!aesd_ioctl(&follower, AESDCHAR_IOCFOLLOW, (unsigned long)&follow),
+	      "AESDCHAR_IOCFOLLOW failed");
+
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+		write_cmd(&writer, "aaaa\n");
+	len = drain(&follower, buf, sizeof buf - 1);
+	CHECK(len == 5 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+	      "drained %zu bytes of a full ring", len);
+
+	/* the ring is full now, each of these evicts the oldest command */
+	expect_follow(&writer, &follower, "0123456789\n");
+	expect_follow(&writer, &follower, "X\n");
+	for (int i = 0; i < 2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+		snprintf(buf, sizeof buf, "command %d\n", i);
+		expect_follow(&writer, &follower, buf);
+	}
+
+	/* a follower which fell behind the window resumes from its oldest byte */
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1; i++)
+		write_cmd(&writer, "bb\n");
+	len = drain(&follower, buf, sizeof buf - 1);
+	CHECK(len == 3 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+	      "lagging follower read %zu bytes", len);
+
+	aesd_release(&inode, &follower);
+	aesd_release(&inode, &writer);
+	aesd_cleanup_module();
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("aesd-follow-test: OK\n");
+	return EXIT_SUCCESS;
+}
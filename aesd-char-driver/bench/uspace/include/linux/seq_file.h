@@ -0,0 +1 @@
+#include "../../uspace-kernel.h"
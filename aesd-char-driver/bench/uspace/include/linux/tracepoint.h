@@ -0,0 +1,16 @@
+#ifndef USPACE_LINUX_TRACEPOINT_H
+#define USPACE_LINUX_TRACEPOINT_H
+
+#include "../../uspace-kernel.h"
+
+/* tracepoints are empty inline functions, so they cost nothing here */
+#define PARAMS(args...)		args
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto) {}
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+	static inline void trace_##name(proto) {}
+
+#endif
@@ -0,0 +1 @@
+/* tracepoints compile to no-ops in user space, see linux/tracepoint.h */
@@ -0,0 +1,214 @@
+/*
+ * uspace-kernel.c
+ *
+ *  @brief Out of line parts of the user-space kernel stand-ins, see
+ *         uspace-kernel.h
+ */
+
+#include "uspace-kernel.h"
+
+/* per-CPU slots */
+
+static int uspace_next_cpu;
+static __thread int uspace_cpu = -1;
+
+int uspace_this_cpu(void)
+{
+	if (uspace_cpu < 0)
+		uspace_cpu = __atomic_fetch_add(&uspace_next_cpu, 1, __ATOMIC_RELAXED) % NR_CPUS;
+	return uspace_cpu;
+}
+
+void *uspace_alloc_percpu(size_t size)
+{
+	if (size > UCPU_STRIDE) {
+		fprintf(stderr, "uspace: per-CPU object of %zu bytes exceeds UCPU_STRIDE\n", size);
+		abort();
+	}
+	return calloc(NR_CPUS, UCPU_STRIDE);
+}
+
+/* char devices */
+
+static unsigned int uspace_next_major = 240;
+
+int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count,
+			const char *name)
+{
+	(void)count;
+	(void)name;
+	*dev = MKDEV(uspace_next_major++, baseminor);
+	return 0;
+}
+
+void unregister_chrdev_region(dev_t dev, unsigned int count)
+{
+	(void)dev;
+	(void)count;
+}
+
+loff_t fixed_size_llseek(struct file *file, loff_t offset, int whence, loff_t size)
+{
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += file->f_pos;
+		break;
+	case SEEK_END:
+		offset += size;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (offset < 0 || offset > size)
+		return -EINVAL;
+	file->f_pos = offset;
+	return offset;
+}
+
+ssize_t copy_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+			 size_t len, unsigned int flags)
+{
+	(void)in;
+	(void)ppos;
+	(void)pipe;
+	(void)len;
+	(void)flags;
+	return -EINVAL;
+}
+
+/* iov_iter, walking a plain iovec array */
+
+static size_t uspace_iter_copy(void *buf, size_t bytes, struct iov_iter *i, bool to_iter)
+{
+	size_t done = 0;
+
+	bytes = min(bytes, i->count);
+	while (done < bytes) {
+		const struct iovec *iov = i->iov;
+		size_t chunk = min(bytes - done, iov->iov_len - i->iov_offset);
+		char *base = (char *)iov->iov_base + i->iov_offset;
+
+		if (to_iter)
+			memcpy(base, (char *)buf + done, chunk);
+		else
+			memcpy((char *)buf + done, base, chunk);
+		done += chunk;
+		i->iov_offset += chunk;
+		i->count -= chunk;
+		if (i->iov_offset == iov->iov_len) {
+			i->iov++;
+			i->nr_segs--;
+			i->iov_offset = 0;
+		}
+	}
+	return done;
+}
+
+size_t copy_from_iter(void *to, size_t bytes, struct iov_iter *i)
+{
+	return uspace_iter_copy(to, bytes, i, false);
+}
+
+size_t copy_to_iter(const void *from, size_t bytes, struct iov_iter *i)
+{
+	return uspace_iter_copy((void *)from, bytes, i, true);
+}
+
+/* debugfs: a tree of named nodes, files keep their show() and data */
+
+struct dentry {
+	char name[64];
+	struct dentry *parent;
+	struct dentry *child;
+	struct dentry *sibling;
+	void *data;
+	const struct file_operations *fops;
+};
+
+static struct dentry uspace_debugfs_root;
+
+static struct dentry *uspace_debugfs_new(const char *name, struct dentry *parent)
+{
+	struct dentry *dentry = calloc(1, sizeof *dentry);
+
+	if (!dentry)
+		return NULL;
+	snprintf(dentry->name, sizeof dentry->name, "%s", name);
+	dentry->parent = parent ? parent : &uspace_debugfs_root;
+	dentry->sibling = dentry->parent->child;
+	dentry->parent->child = dentry;
+	return dentry;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return uspace_debugfs_new(name, parent);
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned short mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops)
+{
+	struct dentry *dentry = uspace_debugfs_new(name, parent);
+
+	(void)mode;
+	if (dentry) {
+		dentry->data = data;
+		dentry->fops = fops;
+	}
+	return dentry;
+}
+
+static void uspace_debugfs_free(struct dentry *dentry)
+{
+	while (dentry->child) {
+		struct dentry *child = dentry->child;
+
+		dentry->child = child->sibling;
+		uspace_debugfs_free(child);
+	}
+	free(dentry);
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+	struct dentry **link;
+
+	if (!dentry)
+		return;
+	for (link = &dentry->parent->child; *link; link = &(*link)->sibling) {
+		if (*link == dentry) {
+			*link = dentry->sibling;
+			break;
+		}
+	}
+	uspace_debugfs_free(dentry);
+}
+
+/*
+ * Run the show() of the debugfs file at @path, relative to the debugfs root,
+ * e.g. "aesdchar/aesdchar0/stats".
+ */
+int uspace_debugfs_show(const char *path, FILE *stream)
+{
+	struct dentry *dentry = &uspace_debugfs_root;
+	char buf[256], *name, *save;
+	struct seq_file m;
+
+	snprintf(buf, sizeof buf, "%s", path);
+	for (name = strtok_r(buf, "/", &save); name; name = strtok_r(NULL, "/", &save)) {
+		for (dentry = dentry->child; dentry; dentry = dentry->sibling)
+			if (!strcmp(dentry->name, name))
+				break;
+		if (!dentry)
+			return -ENOENT;
+	}
+	if (!dentry->fops || !dentry->fops->show)
+		return -EINVAL;
+
+	m.stream = stream;
+	m.private = dentry->data;
+	return dentry->fops->show(&m, NULL);
+}
@@ -0,0 +1,352 @@
+/*
+ * uspace-kernel.h
+ *
+ *  @brief Minimal user-space stand-ins for the kernel interfaces used by the
+ *         aesdchar driver, so main.c can be built into a host binary and have
+ *         its file operations driven by a benchmark, without loading a module.
+ *
+ *  Locks map to pthread primitives, allocations to malloc, user copies to
+ *  memcpy, and per-CPU data to per-thread slots. Everything else the driver
+ *  touches (cdevs, debugfs, tracepoints, mmap) is a no-op or a tiny registry.
+ *  This is not a kernel emulation: it only has to be faithful enough for the
+ *  driver's own logic and locking to be measured.
+ */
+
+#ifndef USPACE_KERNEL_H
+#define USPACE_KERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+/* annotations */
+#define __user
+#define __percpu
+#define __init
+#define __exit
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef unsigned int __poll_t;
+
+#define ERESTARTSYS	512
+
+/* helpers */
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define BUILD_BUG_ON(cond)	_Static_assert(!(cond), #cond)
+#define ilog2(n)		(63 - __builtin_clzll((unsigned long long)(n)))
+#define READ_ONCE(x)		(*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+
+/* module boilerplate */
+#define THIS_MODULE		NULL
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_init(fn)
+#define module_exit(fn)
+#define S_IRUGO			0444
+#define LINUX_VERSION_CODE	KERNEL_VERSION(6, 6, 0)
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+
+#define KERN_ERR		"<3>"
+#define KERN_WARNING		"<4>"
+#define KERN_DEBUG		"<7>"
+#define printk(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+
+/* device numbers */
+#define MINORBITS		20
+#define MINORMASK		((1U << MINORBITS) - 1)
+#define MAJOR(dev)		((unsigned int)((dev) >> MINORBITS))
+#define MINOR(dev)		((unsigned int)((dev) & MINORMASK))
+#define MKDEV(ma, mi)		(((ma) << MINORBITS) | (mi))
+
+/* memory */
+#define GFP_KERNEL		0
+#define PAGE_SIZE		4096UL
+
+static inline void *kmalloc(size_t size, int flags)
+{
+	(void)flags;
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, int flags)
+{
+	(void)flags;
+	return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, int flags)
+{
+	(void)flags;
+	return calloc(n, size);
+}
+
+static inline void *krealloc(const void *ptr, size_t size, int flags)
+{
+	(void)flags;
+	return realloc((void *)ptr, size);
+}
+
+static inline void *kmemdup(const void *src, size_t size, int flags)
+{
+	void *dst = kmalloc(size, flags);
+
+	if (dst)
+		memcpy(dst, src, size);
+	return dst;
+}
+
+static inline void kfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+static inline void *vmalloc_user(size_t size)
+{
+	return calloc(1, size);
+}
+
+static inline void vfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/*
+ * Per-CPU data: every copy lives UCPU_STRIDE bytes after the previous one,
+ * and every thread is bound to one of the NR_CPUS copies on first use.
+ * More threads than copies may share one, hence the atomic updates.
+ */
+#define NR_CPUS			64
+#define UCPU_STRIDE		4096
+
+extern int uspace_this_cpu(void);
+extern void *uspace_alloc_percpu(size_t size);
+
+#define alloc_percpu(type)	((type *)uspace_alloc_percpu(sizeof(type)))
+#define free_percpu(ptr)	free(ptr)
+#define per_cpu_ptr(ptr, cpu) \
+	((__typeof__(ptr))((char *)(ptr) + (size_t)(cpu) * UCPU_STRIDE))
+#define this_cpu_ptr(ptr)	per_cpu_ptr(ptr, uspace_this_cpu())
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < NR_CPUS; (cpu)++)
+#define this_cpu_add(pcp, n) \
+	__atomic_fetch_add(per_cpu_ptr(&(pcp), uspace_this_cpu()), (n), __ATOMIC_RELAXED)
+#define this_cpu_inc(pcp)	this_cpu_add(pcp, 1)
+
+/* locking */
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define mutex_init(lock)	pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_lock(lock)	pthread_mutex_lock(&(lock)->m)
+#define mutex_trylock(lock)	(pthread_mutex_trylock(&(lock)->m) == 0)
+#define mutex_unlock(lock)	pthread_mutex_unlock(&(lock)->m)
+#define mutex_lock_interruptible(lock) pthread_mutex_lock(&(lock)->m)
+
+typedef struct {
+	pthread_mutex_t m;
+	pthread_cond_t c;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	pthread_mutex_init(&wq->m, NULL);
+	pthread_cond_init(&wq->c, NULL);
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq)
+{
+	pthread_mutex_lock(&wq->m);
+	pthread_cond_broadcast(&wq->c);
+	pthread_mutex_unlock(&wq->m);
+}
+
+#define wait_event_interruptible(wq, condition) ({			\
+	pthread_mutex_lock(&(wq).m);					\
+	while (!(condition))						\
+		pthread_cond_wait(&(wq).c, &(wq).m);			\
+	pthread_mutex_unlock(&(wq).m);					\
+	0;								\
+})
+
+/* time */
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* files */
+struct file_operations;
+struct seq_file;
+
+struct cdev {
+	dev_t dev;
+	void *owner;
+	const struct file_operations *ops;
+};
+
+struct inode {
+	struct cdev *i_cdev;
+};
+
+struct file {
+	void *private_data;
+	loff_t f_pos;
+	unsigned int f_flags;
+};
+
+struct kiocb {
+	struct file *ki_filp;
+	loff_t ki_pos;
+};
+
+struct iov_iter {
+	const struct iovec *iov;
+	unsigned long nr_segs;
+	size_t iov_offset;
+	size_t count;
+};
+
+struct vm_area_struct {
+	unsigned long vm_flags;
+	unsigned long vm_pgoff;
+};
+
+struct poll_table_struct;
+struct pipe_inode_info;
+
+struct file_operations {
+	void *owner;
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	ssize_t (*read_iter)(struct kiocb *, struct iov_iter *);
+	ssize_t (*write_iter)(struct kiocb *, struct iov_iter *);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+	loff_t (*llseek)(struct file *, loff_t, int);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+	__poll_t (*poll)(struct file *, struct poll_table_struct *);
+	ssize_t (*splice_read)(struct file *, loff_t *, struct pipe_inode_info *, size_t,
+			       unsigned int);
+	/* user-space only, backs DEFINE_SHOW_ATTRIBUTE() */
+	int (*show)(struct seq_file *, void *);
+};
+
+/* there are no pipes in here, splicing always fails */
+extern ssize_t copy_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+				size_t len, unsigned int flags);
+extern loff_t fixed_size_llseek(struct file *file, loff_t offset, int whence, loff_t size);
+
+extern int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count,
+			       const char *name);
+extern void unregister_chrdev_region(dev_t dev, unsigned int count);
+
+static inline void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+	memset(cdev, 0, sizeof *cdev);
+	cdev->ops = fops;
+}
+
+static inline int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+	(void)count;
+	cdev->dev = dev;
+	return 0;
+}
+
+static inline void cdev_del(struct cdev *cdev)
+{
+	(void)cdev;
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+	return i->count;
+}
+
+extern size_t copy_from_iter(void *to, size_t bytes, struct iov_iter *i);
+extern size_t copy_to_iter(const void *from, size_t bytes, struct iov_iter *i);
+
+/* poll */
+#define EPOLLIN			0x0001
+#define EPOLLOUT		0x0004
+#define EPOLLERR		0x0008
+#define EPOLLRDNORM		0x0040
+#define EPOLLWRNORM		0x0100
+#define poll_wait(filp, wq, p)	do { (void)(filp); (void)(wq); (void)(p); } while (0)
+
+/* mmap */
+#define VM_WRITE		0x00000002UL
+#define VM_MAYWRITE		0x00000020UL
+
+static inline void vm_flags_clear(struct vm_area_struct *vma, unsigned long flags)
+{
+	vma->vm_flags &= ~flags;
+}
+
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+	(void)vma;
+	(void)addr;
+	(void)pgoff;
+	return 0;
+}
+
+/* debugfs, as a registry the benchmark can dump files from */
+struct dentry;
+
+struct seq_file {
+	FILE *stream;
+	void *private;
+};
+
+#define seq_printf(m, fmt, ...)	fprintf((m)->stream, fmt, ##__VA_ARGS__)
+#define seq_puts(m, s)		fputs(s, (m)->stream)
+#define DEFINE_SHOW_ATTRIBUTE(name) \
+	static const struct file_operations name##_fops = { .show = name##_show }
+
+extern struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+extern struct dentry *debugfs_create_file(const char *name, unsigned short mode,
+					  struct dentry *parent, void *data,
+					  const struct file_operations *fops);
+extern void debugfs_remove_recursive(struct dentry *dentry);
+extern int uspace_debugfs_show(const char *path, FILE *stream);
+
+#endif /* USPACE_KERNEL_H */
@@ -12,99 +12,385 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/build_bug.h>
+#include <linux/ktime.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#include "aesd-stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesd-trace.h"
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = 1; // number of independent aesdchar instances
+
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar devices to create (default: 1)");
 
 MODULE_AUTHOR("Rafael Aquini"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;
+
+/*
+ * Device lock wrappers accounting for how often the lock was found taken, and
+ * for how long callers then waited for it, in the stats and the tracepoints
+ */
+static inline void aesd_lock(struct aesd_dev *device)
+{
+	u64 t0;
+
+	if (mutex_trylock(&device->lock)) {
+		device->lock_wait_ns = 0;
+		return;
+	}
+
+	aesd_stat_inc(device, AESD_STAT_LOCK_CONTENDED);
+	t0 = ktime_get_ns();
+	mutex_lock(&device->lock);
+	device->lock_wait_ns = ktime_get_ns() - t0;
+	aesd_stat_add(device, AESD_STAT_LOCK_WAIT_NS, device->lock_wait_ns);
+}
+
+static inline int aesd_lock_interruptible(struct aesd_dev *device)
+{
+	u64 t0;
+
+	if (mutex_trylock(&device->lock)) {
+		device->lock_wait_ns = 0;
+		return 0;
+	}
+
+	aesd_stat_inc(device, AESD_STAT_LOCK_CONTENDED);
+	t0 = ktime_get_ns();
+	if (mutex_lock_interruptible(&device->lock))
+		return -ERESTARTSYS;
+
+	device->lock_wait_ns = ktime_get_ns() - t0;
+	aesd_stat_add(device, AESD_STAT_LOCK_WAIT_NS, device->lock_wait_ns);
+	return 0;
+}
+
+/*
+ * Make room for @count more bytes in @pending, growing it geometrically so
+ * that a command streamed in many small chunks is copied O(1) times per byte.
+ */
+static bool aesd_pending_reserve(struct aesd_pending *pending, size_t count)
+{
+	size_t needed = pending->size + count;
+	size_t capacity = max_t(size_t, pending->capacity, 64);
+	char *buff;
+
+	if (needed < count)
+		return false;
+
+	if (needed <= pending->capacity)
+		return true;
+
+	while (capacity < needed)
+		capacity *= 2;
+
+	buff = krealloc(pending->buffptr, capacity, GFP_KERNEL);
+	if (!buff)
+		return false;
+
+	pending->buffptr = buff;
+	pending->capacity = capacity;
+
+	return true;
+}
+
+/*
+ * A file went away with a partial command still pending: park its bytes on
+ * the device, so the next writer completing a command picks them up just like
+ * 'echo -n foo > dev; echo bar > dev' always did. Must hold device->lock.
+ */
+static void aesd_pending_park(struct aesd_dev *device, struct aesd_pending *pending)
+{
+	struct aesd_pending *parked = &device->pending;
+
+	if (!parked->size) {
+		kfree(parked->buffptr);
+		*parked = *pending;
+		memset(pending, 0, sizeof *pending);
+		return;
+	}
+
+	if (!aesd_pending_reserve(parked, pending->size)) {
+		aesd_stat_inc(device, AESD_STAT_ALLOC_FAILURES);
+		printk(KERN_WARNING "aesdchar: dropping %zu pending bytes\n", pending->size);
+		return;
+	}
+
+	memcpy(parked->buffptr + parked->size, pending->buffptr, pending->size);
+	parked->size += pending->size;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
 	struct aesd_dev *device;
+	struct aesd_file *file;
 
 	PDEBUG("open");
 	device = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = device;
+	file = kzalloc(sizeof *file, GFP_KERNEL);
+	if (!file) {
+		aesd_stat_inc(device, AESD_STAT_ALLOC_FAILURES);
+		return -ENOMEM;
+	}
+
+	file->device = device;
+	filp->private_data = file;
 
 	return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
-    PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
-    return 0;
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *device = file->device;
+
+	PDEBUG("release");
+	if (file->pending.size > 0) {
+		aesd_lock(device);
+		aesd_pending_park(device, &file->pending);
+		mutex_unlock(&device->lock);
+	}
+
+	kfree(file->pending.buffptr);
+	kfree(file);
+	filp->private_data = NULL;
+
+	return 0;
+}
+
+static inline struct aesd_dev *aesd_file_device(struct file *filp)
+{
+	struct aesd_file *file = filp->private_data;
+
+	return file ? file->device : NULL;
 }
 
 static loff_t aesd_buffer_size(struct aesd_dev *device)
 {
-	loff_t size = 0;
-	int index;
+	return device->end - device->start;
+}
+
+/*
+ * The mmap view is updated as a sequence count: the generation goes odd
+ * before the data ring is touched and even again once the header describes
+ * it, so lockless readers of the mapping can tell their view was torn.
+ * A whole batch of commands is published under a single odd period.
+ * Must be called with device->lock held.
+ */
+static void aesd_map_begin(struct aesd_dev *device)
+{
+	struct aesd_mmap_header *hdr = device->map;
+
+	WRITE_ONCE(hdr->generation, hdr->generation + 1);
+	smp_wmb();
+}
+
+static void aesd_map_end(struct aesd_dev *device)
+{
+	struct aesd_mmap_header *hdr = device->map;
+
+	hdr->start = max_t(loff_t, device->start, device->end - (loff_t)hdr->capacity);
+	hdr->length = device->end - hdr->start;
+
+	smp_wmb();
+	WRITE_ONCE(hdr->generation, hdr->generation + 1);
+}
+
+/*
+ * Mirror the bytes of a freshly committed command, which end at device->end,
+ * into the mmap data ring.
+ */
+static void aesd_map_append(struct aesd_dev *device, const char *buf, size_t len)
+{
+	struct aesd_mmap_header *hdr = device->map;
+	char *data = (char *)hdr + hdr->data_offset;
+	size_t capacity = hdr->capacity;
+	loff_t pos = device->end - len;
+	size_t offs, chunk;
+
+	/* only the trailing capacity bytes of a huge command can be kept */
+	if (len > capacity) {
+		buf += len - capacity;
+		pos += len - capacity;
+		len = capacity;
+	}
+
+	offs = pos & (capacity - 1);
+	chunk = min(len, capacity - offs);
+	memcpy(data + offs, buf, chunk);
+	memcpy(data, buf + chunk, len - chunk);
+}
+
+/*
+ * Push a complete command into the circular buffer, releasing whatever entry
+ * got evicted to make room for it. Must be called with device->lock held,
+ * between aesd_map_begin() and aesd_map_end().
+ */
+static void aesd_commit_entry(struct aesd_dev *device, struct aesd_buffer_entry *entry)
+{
+	struct aesd_buffer_entry *old_entry;
+
+	old_entry = aesd_circular_buffer_add_entry(&device->queue, entry);
+	trace_aesd_write_commit(device, entry, device->end);
+	device->end += entry->size;
+	aesd_stat_entry_size(device, entry->size);
+	if (old_entry != NULL) {
+		trace_aesd_write_evict(device, old_entry, device->start);
+		aesd_stat_inc(device, AESD_STAT_EVICTIONS);
+		device->start += old_entry->size;
+		device->ring_gen++;
+		kfree(old_entry->buffptr);
+		kfree(old_entry);
+	}
+
+	aesd_map_append(device, entry->buffptr, entry->size);
+}
+
+/*
+ * Translate @fpos into an entry and the @byte within it, resuming from where
+ * the file's last read left off. Sequential readers only ever step at most
+ * one entry ahead, anything else, or an eviction since the last call,
+ * restarts the walk from the oldest entry. Must hold device->lock.
+ */
+static struct aesd_buffer_entry *aesd_cursor_find(struct aesd_dev *device,
+						  struct aesd_read_cursor *cursor,
+						  loff_t fpos, size_t *byte)
+{
+	struct aesd_buffer_entry *entry;
+	loff_t pos = device->start + fpos;
+
+	if (cursor->generation != device->ring_gen || pos < cursor->start) {
+		cursor->generation = device->ring_gen;
+		cursor->start = device->start;
+		cursor->index = device->queue.out_offs;
+	}
+
+	for (;;) {
+		entry = device->queue.entry[cursor->index];
+		if (!entry)
+			return NULL;
+
+		if (pos < cursor->start + (loff_t)entry->size) {
+			*byte = pos - cursor->start;
+			return entry;
+		}
 
-	for (index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++) {
-		struct aesd_buffer_entry *entry = device->queue.entry[index];
+		if (cursor->start + (loff_t)entry->size >= device->end)
+			return NULL;
 
-		if (entry != NULL)
-			size += entry->size;
+		cursor->start += entry->size;
+		cursor->index = (cursor->index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 	}
+}
+
+/*
+ * A follower's file offset keeps naming the same stream byte however far the
+ * window slides between two calls, so it never skips data nor misses the end
+ * of it once commands get evicted. Returns the offset @fpos stands for now,
+ * clamped to the oldest byte still held. Must hold device->lock.
+ */
+static loff_t aesd_follow_pos(struct aesd_dev *device, struct aesd_file *file, loff_t fpos)
+{
+	if (!file->follow)
+		return fpos;
 
-	return size;
+	return max(file->base + fpos, device->start) - device->start;
 }
 
 static loff_t __aesd_llseek(struct aesd_dev *device, struct file *filp, loff_t off, int whence)
 {
-	return fixed_size_llseek(filp, off, whence, aesd_buffer_size(device));
+	struct aesd_file *file = filp->private_data;
+	loff_t ret;
+
+	filp->f_pos = aesd_follow_pos(device, file, filp->f_pos);
+	ret = fixed_size_llseek(filp, off, whence, aesd_buffer_size(device));
+	file->base = device->start;
+
+	return ret;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
-	struct aesd_dev *device = filp->private_data;
+	struct aesd_dev *device = aesd_file_device(filp);
 	loff_t ret;
 
 	if (!device)
 		return -EBADF;
 
-	mutex_lock(&device->lock);
+	aesd_lock(device);
 	ret = __aesd_llseek(device, filp, off, whence);
 	mutex_unlock(&device->lock);
 
 	return ret;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Common read path: copy up to @count bytes of the command found at @f_pos,
+ * into either @buf or @to.
+ */
+static ssize_t __aesd_read(struct file *filp, char __user *buf, struct iov_iter *to,
+			   size_t count, loff_t *f_pos)
 {
-	struct aesd_buffer_entry *entry;
+	struct aesd_file *file = filp->private_data;
+	struct aesd_buffer_entry *entry = NULL;
 	struct aesd_dev *device;
 	ssize_t retval = 0;
-	size_t byte = 0;
+	size_t byte = 0, copied;
 	loff_t size = 0;
 
-	PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
-	device = filp->private_data;
+	device = aesd_file_device(filp);
 
 	if (!device)
 		return -ENXIO;
 
-	if (mutex_lock_interruptible(&device->lock))
+	if (aesd_lock_interruptible(device))
 		return -ERESTARTSYS;
 
+	*f_pos = aesd_follow_pos(device, file, *f_pos);
+	file->base = device->start;
 	size = aesd_buffer_size(device);
+	while (*f_pos >= size && file->follow) {
+		loff_t next = device->start + *f_pos;
+
+		mutex_unlock(&device->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(device->waitq, READ_ONCE(device->end) > next))
+			return -ERESTARTSYS;
+
+		if (aesd_lock_interruptible(device))
+			return -ERESTARTSYS;
+
+		*f_pos = aesd_follow_pos(device, file, *f_pos);
+		file->base = device->start;
+		size = aesd_buffer_size(device);
+	}
+
 	if (*f_pos > size)
 		goto nothing;
 
-	entry = aesd_circular_buffer_find_entry_offset_for_fpos(&device->queue, *f_pos, &byte);
+	entry = aesd_cursor_find(device, &file->cursor, *f_pos, &byte);
 	if (!entry)
 		goto nothing;
 
@@ -115,114 +401,241 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_p
 		count = entry->size;
 
 	if (count + byte > entry->size)
-		count -= byte;
+		count = entry->size - byte;
+
+	if (to)
+		copied = copy_to_iter(entry->buffptr + byte, count, to);
+	else
+		copied = count - copy_to_user(buf, entry->buffptr + byte, count);
 
-	if (copy_to_user(buf, entry->buffptr+byte, count)) {
+	if (copied != count) {
 		retval = -EFAULT;
 		goto nothing;
 	}
 
+	trace_aesd_read(device, *f_pos, count, entry, byte, count);
 	*f_pos += count;
+	aesd_stat_add(device, AESD_STAT_BYTES_READ, count);
+	if (byte + count == entry->size)
+		aesd_stat_inc(device, AESD_STAT_CMDS_READ);
 	mutex_unlock(&device->lock);
 	return count;
 nothing:
+	trace_aesd_read(device, *f_pos, count, entry, byte, retval);
 	mutex_unlock (&device->lock);
 	return retval;
 }
 
-static struct aesd_buffer_entry pending_cmd = {.buffptr = NULL, .size = 0};
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+	PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+	return __aesd_read(filp, buf, NULL, count, f_pos);
+}
 
-static bool realloc_cmd_entry(struct aesd_buffer_entry *entry, char *new_cmd, size_t cmd_len)
+/*
+ * readv(2) entry point, also what splice(2) from the device goes through:
+ * copy_splice_read() hands us an iterator over freshly allocated pipe pages.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	size_t size = entry->size + cmd_len;
-	char *buff = kzalloc(size + 1, GFP_KERNEL);
+	PDEBUG("read_iter %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
+	return __aesd_read(iocb->ki_filp, NULL, to, iov_iter_count(to), &iocb->ki_pos);
+}
 
-	if (!buff)
-		return false;
+/*
+ * Turn every complete command held in @pending into a circular buffer entry,
+ * looking for newlines from byte @scan onwards, and keep whatever trails the
+ * last newline as the new partial command.
+ *
+ * All entries are allocated before the first one is committed, so either the
+ * whole batch becomes visible to readers at once or nothing does. Commands
+ * that the rest of the batch would evict straight away are never allocated,
+ * they only move the stream offsets along. Must hold device->lock.
+ */
+static int aesd_pending_flush(struct aesd_dev *device, struct aesd_pending *pending, size_t scan)
+{
+	struct aesd_buffer_entry *batch[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	size_t ends[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1];
+	size_t skipped, done;
+	int i, n = 0, total = 0;
+	char *nl;
+
+	/*
+	 * ends[] slides over the boundaries of the last commands found, ends[0]
+	 * being where the oldest surviving command starts.
+	 */
+	ends[0] = 0;
+	while ((nl = memchr(pending->buffptr + scan, '\n', pending->size - scan)) != NULL) {
+		scan = nl - pending->buffptr + 1;
+		if (n == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+			memmove(ends, ends + 1, n * sizeof *ends);
+			n--;
+		}
+		ends[++n] = scan;
+		total++;
+	}
 
-	memcpy(buff, entry->buffptr, entry->size);
-	strcat(buff, new_cmd);
-	kfree(entry->buffptr);
-	entry->buffptr = buff;
-	entry->size = size;
+	if (!n)
+		return 0;
 
-	return true;
+	skipped = ends[0];
+	done = ends[n];
+
+	/* the common case, a single command: hand the buffer over as it is */
+	if (n == 1 && done == pending->size) {
+		batch[0] = kmalloc(sizeof *batch[0], GFP_KERNEL);
+		if (!batch[0])
+			return -ENOMEM;
+
+		batch[0]->buffptr = pending->buffptr;
+		batch[0]->size = done;
+		memset(pending, 0, sizeof *pending);
+		goto commit;
+	}
+
+	for (i = 0; i < n; i++) {
+		size_t len = ends[i + 1] - ends[i];
+
+		batch[i] = kmalloc(sizeof *batch[i], GFP_KERNEL);
+		if (!batch[i])
+			goto nomem;
+
+		batch[i]->buffptr = kmemdup(pending->buffptr + ends[i], len, GFP_KERNEL);
+		if (!batch[i]->buffptr) {
+			kfree(batch[i]);
+			goto nomem;
+		}
+		batch[i]->size = len;
+	}
+
+	memmove(pending->buffptr, pending->buffptr + done, pending->size - done);
+	pending->size -= done;
+
+commit:
+	aesd_map_begin(device);
+	/* a full batch evicts every older entry, skipped commands included */
+	device->start += skipped;
+	device->end += skipped;
+	if (skipped)
+		device->ring_gen++;
+	device->queue.next_seq += total - n;
+	aesd_stat_add(device, AESD_STAT_EVICTIONS, total - n);
+	aesd_stat_add(device, AESD_STAT_CMDS_WRITTEN, total);
+	for (i = 0; i < n; i++)
+		aesd_commit_entry(device, batch[i]);
+	aesd_map_end(device);
+
+	wake_up_interruptible(&device->waitq);
+
+	return 0;
+nomem:
+	while (--i >= 0) {
+		kfree(batch[i]->buffptr);
+		kfree(batch[i]);
+	}
+
+	return -ENOMEM;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Common write path: append @count bytes, taken from either @buf or @from,
+ * to the file's partial command and commit every command they complete, all
+ * under a single hold of the device lock.
+ */
+static ssize_t __aesd_write(struct file *filp, const char __user *buf,
+			    struct iov_iter *from, size_t count)
 {
-	struct aesd_buffer_entry *entry;
+	struct aesd_file *file = filp->private_data;
+	struct aesd_pending *pending;
 	struct aesd_dev *device;
-	char *new_cmd;
-	ssize_t retval = -ENOMEM;
+	ssize_t retval = count;
+	size_t old_size, copied;
 
-	PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-	device = filp->private_data;
+	device = aesd_file_device(filp);
 
 	if (!device)
 		return -ENXIO;
 
-	if (mutex_lock_interruptible(&device->lock))
+	if (!count)
+		return 0;
+
+	if (aesd_lock_interruptible(device))
 		return -ERESTARTSYS;
 
-	new_cmd = kzalloc(count + 1, GFP_KERNEL);
-	if (!new_cmd)
-		goto nomem;
+	/* adopt a partial command left behind by a file that has been closed */
+	pending = &file->pending;
+	if (!pending->size && device->pending.size > 0) {
+		kfree(pending->buffptr);
+		*pending = device->pending;
+		memset(&device->pending, 0, sizeof device->pending);
+	}
 
-	entry = kzalloc(sizeof *entry, GFP_KERNEL);
-	if (!entry) {
-		kfree(new_cmd);
-		goto nomem;
+	trace_aesd_write_enter(device, count, pending->size);
+	if (!aesd_pending_reserve(pending, count)) {
+		aesd_stat_inc(device, AESD_STAT_ALLOC_FAILURES);
+		retval = -ENOMEM;
+		goto out;
 	}
 
-	if (copy_from_user(new_cmd, buf, count)) {
+	old_size = pending->size;
+	if (old_size > 0)
+		aesd_stat_inc(device, AESD_STAT_PARTIAL_MERGES);
+
+	if (from)
+		copied = copy_from_iter(pending->buffptr + old_size, count, from);
+	else
+		copied = count - copy_from_user(pending->buffptr + old_size, buf, count);
+
+	if (copied != count) {
 		retval = -EFAULT;
-		kfree(new_cmd);
-		kfree(entry);
-		goto nomem;
-	}
-
-	if (new_cmd[count-1] != '\n') {
-		bool ret = realloc_cmd_entry(&pending_cmd, new_cmd, count);
-
-		kfree(new_cmd);
-		kfree(entry);
-		entry = NULL;
-		if (ret == false)
-		       goto nomem;
-	} else if (new_cmd[count-1] == '\n' && pending_cmd.size > 0) {
-		bool ret = realloc_cmd_entry(&pending_cmd, new_cmd, count);
-
-		kfree(new_cmd);
-		if (ret == false)
-		       goto nomem;
-
-		entry->buffptr = pending_cmd.buffptr;
-		entry->size = pending_cmd.size;
-		entry = aesd_circular_buffer_add_entry(&device->queue, entry);
-		memset(&pending_cmd, 0, sizeof pending_cmd);
-	} else {
-		entry->buffptr = new_cmd;
-		entry->size = count;
-		entry = aesd_circular_buffer_add_entry(&device->queue, entry);
+		goto out;
 	}
+	pending->size += count;
 
-	if (entry != NULL) {
-		kfree(entry->buffptr);
-		kfree(entry);
+	if (aesd_pending_flush(device, pending, old_size)) {
+		aesd_stat_inc(device, AESD_STAT_ALLOC_FAILURES);
+		pending->size = old_size;
+		retval = -ENOMEM;
+	} else {
+		aesd_stat_add(device, AESD_STAT_BYTES_WRITTEN, count);
 	}
-
-	*f_pos += count;
-	mutex_unlock(&device->lock);
-	return count;
-nomem:
+out:
 	mutex_unlock(&device->lock);
 	return retval;
 }
 
-static long aesd_adjust_file_offset(struct file *filp, uint32_t cmd, uint32_t cmd_offset)
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+	ssize_t retval;
+
+	PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+	retval = __aesd_write(filp, buf, NULL, count);
+	if (retval > 0)
+		*f_pos += retval;
+
+	return retval;
+}
+
+/*
+ * writev(2) entry point: an iovec carrying many commands is committed as one
+ * batch, with a single lock acquisition.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t retval;
+
+	PDEBUG("write_iter %zu bytes with offset %lld", iov_iter_count(from), iocb->ki_pos);
+	retval = __aesd_write(iocb->ki_filp, NULL, from, iov_iter_count(from));
+	if (retval > 0)
+		iocb->ki_pos += retval;
+
+	return retval;
+}
+
+static long aesd_adjust_file_offset(struct file *filp, uint32_t cmd, uint32_t cmd_offset,
+				    struct aesd_ioctl_trace *trace)
 {
-	struct aesd_dev *device = filp->private_data;
+	struct aesd_dev *device = aesd_file_device(filp);
 	struct aesd_buffer_entry *entry;
 	loff_t ret, offset = 0;
 	uint8_t index, i;
@@ -233,15 +646,19 @@ static long aesd_adjust_file_offset(struct file *filp, uint32_t cmd, uint32_t cm
 	if (cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
 		return -EINVAL;
 
-	mutex_lock(&device->lock);
+	aesd_lock(device);
+	trace->lock_wait_ns = device->lock_wait_ns;
 	index = device->queue.out_offs;
 
+	/* entries are contiguous from out_offs, a hole means cmd is not there */
 	for (i = 0; ; i++) {
 		entry = device->queue.entry[index];
 		index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 
-		if (!entry)
-			continue;
+		if (!entry) {
+			mutex_unlock(&device->lock);
+			return -EINVAL;
+		}
 
 		if (i == cmd)
 			break;
@@ -256,95 +673,335 @@ static long aesd_adjust_file_offset(struct file *filp, uint32_t cmd, uint32_t cm
 
 	offset += cmd_offset;
 	ret = __aesd_llseek(device, filp, offset, SEEK_SET);
+	trace->pos = ret;
+	trace->index = cmd;
 	mutex_unlock(&device->lock);
 
 	return ret;
 }
 
-long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static long aesd_get_index(struct file *filp, struct aesd_index __user *uindex,
+			   struct aesd_ioctl_trace *trace)
 {
+	struct aesd_dev *device = aesd_file_device(filp);
+	struct aesd_circular_buffer *queue;
+	struct aesd_index index;
+	uint64_t offset = 0;
+	uint8_t slot;
+	int i;
+
+	BUILD_BUG_ON(AESD_INDEX_MAX_ENTRIES != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+
+	if (!device)
+		return -ENOTTY;
+
+	memset(&index, 0, sizeof index);
+
+	aesd_lock(device);
+	trace->lock_wait_ns = device->lock_wait_ns;
+	queue = &device->queue;
+	index.start = device->start;
+	index.size = aesd_buffer_size(device);
+
+	slot = queue->out_offs;
+	for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+		struct aesd_buffer_entry *entry = queue->entry[slot];
+
+		slot = (slot + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+		if (!entry)
+			continue;
+
+		index.entry[index.count].offset = offset;
+		index.entry[index.count].size = entry->size;
+		index.entry[index.count].seq = entry->seq;
+		index.count++;
+		offset += entry->size;
+	}
+	mutex_unlock(&device->lock);
+
+	if (copy_to_user(uindex, &index, sizeof index))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long aesd_seek_to_seq(struct file *filp, struct aesd_seekto_seq __user *useek,
+			     struct aesd_ioctl_trace *trace)
+{
+	struct aesd_dev *device = aesd_file_device(filp);
+	struct aesd_circular_buffer *queue;
+	struct aesd_buffer_entry *entry;
+	struct aesd_seekto_seq seek;
+	loff_t ret, offset = 0;
+	uint8_t slot;
+
+	if (!device)
+		return -ENOTTY;
+
+	if (copy_from_user(&seek, useek, sizeof seek))
+		return -EFAULT;
+
+	aesd_lock(device);
+	trace->lock_wait_ns = device->lock_wait_ns;
+	queue = &device->queue;
+	entry = queue->entry[queue->out_offs];
+	seek.next = queue->next_seq;
+	seek.oldest = entry ? entry->seq : seek.next;
+
+	if (seek.seq > seek.next) {
+		ret = -EINVAL;
+	} else if (seek.seq < seek.oldest) {
+		ret = -ENOENT;
+	} else {
+		/* held entries carry consecutive numbers, oldest first */
+		slot = queue->out_offs;
+		for (uint64_t seq = seek.oldest; seq < seek.seq; seq++) {
+			offset += queue->entry[slot]->size;
+			slot = (slot + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+		}
+		ret = __aesd_llseek(device, filp, offset, SEEK_SET);
+		trace->pos = ret;
+		trace->index = seek.seq - seek.oldest;
+	}
+	mutex_unlock(&device->lock);
+
+	if (copy_to_user(useek, &seek, sizeof seek))
+		return -EFAULT;
+
+	return ret;
+}
+
+static long __aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg,
+			 struct aesd_ioctl_trace *trace)
+{
+	struct aesd_file *file = filp->private_data;
 	struct aesd_seekto seekto;
+	uint32_t follow;
 
 	switch (cmd) {
 	case AESDCHAR_IOCSEEKTO:
 		if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)))
 			return -EFAULT;
 
-		return aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
+		return aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset,
+					       trace);
+	case AESDCHAR_IOCFOLLOW:
+		if (copy_from_user(&follow, (const void __user *)arg, sizeof(follow)))
+			return -EFAULT;
+
+		/* from now on the file offset is pinned to the byte it names */
+		aesd_lock(file->device);
+		trace->lock_wait_ns = file->device->lock_wait_ns;
+		file->follow = follow != 0;
+		file->base = file->device->start;
+		mutex_unlock(&file->device->lock);
+		return 0;
+	case AESDCHAR_IOCGETINDEX:
+		return aesd_get_index(filp, (struct aesd_index __user *)arg, trace);
+	case AESDCHAR_IOCSEEKTOSEQ:
+		return aesd_seek_to_seq(filp, (struct aesd_seekto_seq __user *)arg, trace);
 	}
 
 	return -ENOTTY;
 }
 
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct aesd_dev *device = aesd_file_device(filp);
+	struct aesd_ioctl_trace trace = { .lock_wait_ns = 0, .pos = -1, .index = -1 };
+	long ret;
+
+	ret = __aesd_ioctl(filp, cmd, arg, &trace);
+	if (device)
+		trace_aesd_ioctl(device, cmd, ret, &trace);
+
+	return ret;
+}
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct aesd_dev *device = aesd_file_device(filp);
+
+	if (!device)
+		return -ENXIO;
+
+	/* the view is strictly read-only, and must not be made writable later */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, device->map, vma->vm_pgoff);
+}
+
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *device = aesd_file_device(filp);
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	if (!device)
+		return EPOLLERR;
+
+	poll_wait(filp, &device->waitq, wait);
+
+	aesd_lock(device);
+	if (aesd_follow_pos(device, file, filp->f_pos) < aesd_buffer_size(device))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	mutex_unlock(&device->lock);
+
+	return mask;
+}
+
 struct file_operations aesd_fops = {
     .owner	= THIS_MODULE,
     .read	= aesd_read,
+    .read_iter	= aesd_read_iter,
     .write	= aesd_write,
+    .write_iter	= aesd_write_iter,
     .open	= aesd_open,
     .release	= aesd_release,
     .llseek	= aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap	= aesd_mmap,
+    .poll	= aesd_poll,
+    /*
+     * Not zero-copy: entries are kmalloc'd and get evicted, so they cannot be
+     * lent to a pipe. splice(2) copies each byte once, through aesd_read_iter().
+     */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd%d cdev", err, index);
     }
     return err;
 }
 
+static int aesd_init_device(struct aesd_dev *device, int index)
+{
+	mutex_init(&device->lock);
+	init_waitqueue_head(&device->waitq);
+	aesd_circular_buffer_init(&device->queue);
+	/* freshly opened files have a zeroed cursor, never valid */
+	device->ring_gen = 1;
+
+	/* the header takes the first page, the data ring follows it */
+	device->map = vmalloc_user(PAGE_SIZE + AESD_MMAP_DATA_SIZE);
+	if (!device->map)
+		return -ENOMEM;
+
+	device->map->data_offset = PAGE_SIZE;
+	device->map->capacity = AESD_MMAP_DATA_SIZE;
+
+	if (aesd_stats_init(device, index)) {
+		vfree(device->map);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void aesd_destroy_device(struct aesd_dev *device)
+{
+	struct aesd_circular_buffer *buffer = &device->queue;
+
+	aesd_lock(device);
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+		struct aesd_buffer_entry *entry = buffer->entry[i];
+
+		if (entry != NULL) {
+			kfree(entry->buffptr);
+			kfree(entry);
+		}
+	}
+	mutex_unlock(&device->lock);
+
+	kfree(device->pending.buffptr);
+
+	aesd_stats_destroy(device);
+	vfree(device->map);
+}
+
 int aesd_init_module(void)
 {
 	dev_t dev = 0;
-	int result;
+	int i, result;
+
+	if (aesd_nr_devs < 1 || aesd_nr_devs > MINORMASK) {
+		printk(KERN_WARNING "Invalid number of devices %d\n", aesd_nr_devs);
+		return -EINVAL;
+	}
 
-	result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+	result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs, "aesdchar");
 	aesd_major = MAJOR(dev);
 	if (result < 0) {
 		printk(KERN_WARNING "Can't get major %d\n", aesd_major);
 		return result;
 	}
 
-	memset(&aesd_device, 0, sizeof aesd_device);
-	mutex_init(&aesd_device.lock);
-	aesd_circular_buffer_init(&aesd_device.queue);
+	aesd_devices = kcalloc(aesd_nr_devs, sizeof *aesd_devices, GFP_KERNEL);
+	if (!aesd_devices) {
+		result = -ENOMEM;
+		goto fail_region;
+	}
+
+	aesd_stats_debugfs_init();
+
+	for (i = 0; i < aesd_nr_devs; i++) {
+		result = aesd_init_device(&aesd_devices[i], i);
+		if (result)
+			goto fail_devices;
 
-	result = aesd_setup_cdev(&aesd_device);
-	if (result)
-		unregister_chrdev_region(dev, 1);
+		result = aesd_setup_cdev(&aesd_devices[i], i);
+		if (result) {
+			aesd_destroy_device(&aesd_devices[i]);
+			goto fail_devices;
+		}
+	}
 
+	return 0;
+
+fail_devices:
+	while (--i >= 0) {
+		cdev_del(&aesd_devices[i].cdev);
+		aesd_destroy_device(&aesd_devices[i]);
+	}
+	kfree(aesd_devices);
+	aesd_stats_debugfs_exit();
+fail_region:
+	unregister_chrdev_region(dev, aesd_nr_devs);
 	return result;
 }
 
 void aesd_cleanup_module(void)
 {
-	struct aesd_circular_buffer *buffer = &aesd_device.queue;
 	dev_t devno = MKDEV(aesd_major, aesd_minor);
 
-	cdev_del(&aesd_device.cdev);
-
-	mutex_lock(&aesd_device.lock);
-	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-		struct aesd_buffer_entry *entry = buffer->entry[i];
-
-		if (entry != NULL) {
-			kfree(entry->buffptr);
-			kfree(entry);
-		}
+	for (int i = 0; i < aesd_nr_devs; i++) {
+		cdev_del(&aesd_devices[i].cdev);
+		aesd_destroy_device(&aesd_devices[i]);
 	}
-	mutex_unlock(&aesd_device.lock);
-
-	if (pending_cmd.size > 0)
-		kfree(pending_cmd.buffptr);
+	kfree(aesd_devices);
+	aesd_stats_debugfs_exit();
 
-	unregister_chrdev_region(devno, 1);
+	unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
@@ -0,0 +1,203 @@
+/**
+ * @file execpool-bench.c
+ * @brief Compare ways of running the same command many times
+ *
+ * Runs a command repeatedly with:
+ *   fork      fork() + execv() + waitpid(), what do_exec() used to do
+ *   exec_many posix_spawn() based do_exec_many(), one command per batch
+ *   pool      exec_pool_run() on helpers forked before the ballast
+ * after growing the process by a ballast of touched memory, since the cost
+ * of fork() depends on how big the parent is. Reports commands per second.
+ *
+ * Usage: execpool-bench [-n iterations] [-m ballast MiB] [-j threads]
+ *                       [-p helpers] [command [args...]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+#include "execpool.h"
+
+enum bench_mode { MODE_FORK, MODE_EXEC_MANY, MODE_POOL, MODE_NR };
+
+static const char *mode_names[MODE_NR] = {
+	[MODE_FORK]	= "fork",
+	[MODE_EXEC_MANY] = "exec_many",
+	[MODE_POOL]	= "pool",
+};
+
+static char *default_argv[] = { "/bin/true", NULL };
+
+struct bench_ctx {
+	enum bench_mode mode;
+	char **argv;
+	unsigned long iterations;
+	struct exec_pool *pool;
+	unsigned long failures;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool run_fork(char **argv)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return false;
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static bool run_exec_many(char **argv)
+{
+	struct exec_cmd cmd = { .argv = argv };
+
+	/* do_exec() is variadic, so it cannot take argv as given on the command line */
+	return do_exec_many(&cmd, 1, 1) == 0;
+}
+
+static bool run_pool(struct exec_pool *pool, char **argv)
+{
+	struct exec_result res;
+	bool ok;
+
+	ok = exec_pool_run(pool, argv, &res);
+	free(res.out);
+	free(res.err);
+	return ok;
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+
+	for (unsigned long i = 0; i < ctx->iterations; i++) {
+		bool ok = false;
+
+		switch (ctx->mode) {
+		case MODE_FORK:
+			ok = run_fork(ctx->argv);
+			break;
+		case MODE_EXEC_MANY:
+			ok = run_exec_many(ctx->argv);
+			break;
+		case MODE_POOL:
+			ok = run_pool(ctx->pool, ctx->argv);
+			break;
+		default:
+			break;
+		}
+		if (!ok)
+			ctx->failures++;
+	}
+
+	return NULL;
+}
+
+static void bench(enum bench_mode mode, char **argv, unsigned long iterations,
+		  int threads, struct exec_pool *pool, size_t ballast_mb)
+{
+	struct bench_ctx ctx[threads];
+	pthread_t tids[threads];
+	unsigned long failures = 0;
+	uint64_t start, elapsed;
+
+	start = now_ns();
+	for (int i = 0; i < threads; i++) {
+		ctx[i] = (struct bench_ctx){ mode, argv, iterations, pool, 0 };
+		if (pthread_create(&tids[i], NULL, bench_worker, &ctx[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		failures += ctx[i].failures;
+	}
+	elapsed = now_ns() - start;
+
+	printf("%-9s ballast=%zuMiB threads=%d %10.1f cmds/s %10.1f us/cmd %lu failures\n",
+	       mode_names[mode], ballast_mb, threads,
+	       (double)iterations * threads / (elapsed / 1e9),
+	       elapsed / 1e3 / iterations, failures);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 2000;
+	size_t ballast_mb = 256;
+	int threads = 1, helpers = 4, opt;
+	struct exec_pool *pool;
+	char **cmd = default_argv;
+	char *ballast;
+
+	while ((opt = getopt(argc, argv, "n:m:j:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			ballast_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'p':
+			helpers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] [-m ballast MiB] [-j threads] "
+				"[-p helpers] [command [args...]]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		cmd = &argv[optind];
+	if (!iterations || threads < 1) {
+		fprintf(stderr, "%s: iterations and threads must be positive\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* the helpers are forked while we are still small */
+	pool = exec_pool_create(helpers, 0);
+	if (!pool) {
+		fprintf(stderr, "exec_pool_create failed\n");
+		return EXIT_FAILURE;
+	}
+
+	ballast = malloc(ballast_mb << 20);
+	if (ballast_mb && !ballast) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	memset(ballast, 1, ballast_mb << 20);
+
+	for (int mode = 0; mode < MODE_NR; mode++)
+		bench(mode, cmd, iterations, threads, pool, ballast_mb);
+
+	exec_pool_destroy(pool);
+	free(ballast);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,411 @@
+#define _GNU_SOURCE  /* for enabling asprintf */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "systemcalls.h"
+#include "execpool.h"
+
+/*
+ * Requests and replies travel over SOCK_SEQPACKET socketpairs, so message
+ * boundaries are kept. A request is the argument vector as consecutive NUL
+ * terminated strings. A reply is a struct pool_reply, followed by the
+ * captured stdout and then stderr, in messages of at most POOL_MSG_MAX.
+ *
+ * Helpers are not forked by the pool's callers, which may have grown big and
+ * be running many threads by the time one is needed, but by a spawner process
+ * forked along with the pool. Asked for a helper, it forks one and passes our
+ * end of its socketpair back over SCM_RIGHTS, along with its pid.
+ */
+#define POOL_MSG_MAX	65536
+#define POOL_MAX_ARGS	256
+
+struct pool_reply {
+	int32_t status;
+	uint8_t truncated;
+	uint64_t out_len;
+	uint64_t err_len;
+};
+
+struct pool_helper {
+	pid_t pid;		/* a child of the spawner, not ours */
+	int fd;			/* our end of the socketpair */
+	bool busy;
+};
+
+struct exec_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t idle;	/* signalled when a helper is released */
+	pthread_mutex_t spawn_lock;	/* one request to the spawner at a time */
+	pid_t spawner_pid;
+	int spawner_fd;
+	size_t max_output;
+	int nr_helpers;
+	struct pool_helper helpers[];
+};
+
+static bool send_all(int fd, const char *buf, size_t len)
+{
+	do {
+		size_t chunk = len < POOL_MSG_MAX ? len : POOL_MSG_MAX;
+
+		if (send(fd, buf, chunk, MSG_NOSIGNAL) != (ssize_t)chunk)
+			return false;
+		buf += chunk;
+		len -= chunk;
+	} while (len);
+
+	return true;
+}
+
+static bool recv_all(int fd, char *buf, size_t len)
+{
+	while (len) {
+		size_t chunk = len < POOL_MSG_MAX ? len : POOL_MSG_MAX;
+		ssize_t n = recv(fd, buf, chunk, 0);
+
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* the helper side: run whatever comes in until the pool goes away */
+static void helper_loop(int fd, size_t max_output)
+{
+	static char req[POOL_MSG_MAX];
+	char *argv[POOL_MAX_ARGS + 1];
+	ssize_t n;
+
+	while ((n = recv(fd, req, sizeof (req) - 1, 0)) > 0) {
+		struct exec_capture cap = { .max_size = max_output };
+		struct pool_reply reply;
+		int argc = 0;
+
+		req[n] = '\0';
+		for (char *p = req; p < req + n && argc < POOL_MAX_ARGS; p += strlen(p) + 1)
+			argv[argc++] = p;
+		argv[argc] = NULL;
+
+		do_execv_capture(&cap, argv);
+
+		memset(&reply, 0, sizeof (reply));
+		reply.status = cap.status;
+		reply.truncated = cap.truncated;
+		reply.out_len = cap.out_len;
+		reply.err_len = cap.err_len;
+		if (send(fd, &reply, sizeof (reply), MSG_NOSIGNAL) != sizeof (reply) ||
+		    (cap.out_len && !send_all(fd, cap.out, cap.out_len)) ||
+		    (cap.err_len && !send_all(fd, cap.err, cap.err_len)))
+			break;
+
+		free(cap.out);
+		free(cap.err);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+/* the spawner side: fork a helper per request, until the pool goes away */
+static void spawner_loop(int fd, size_t max_output)
+{
+	char req, cbuf[CMSG_SPACE(sizeof (int))];
+	ssize_t n;
+
+	while ((n = recv(fd, &req, sizeof (req), 0)) > 0 || (n < 0 && errno == EINTR)) {
+		struct iovec iov;
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+		pid_t pid = -1;
+		int sv[2];
+
+		if (n < 0)
+			continue;
+
+		/* reap the helpers which died since */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+
+		memset(&msg, 0, sizeof (msg));
+		iov.iov_base = &pid;
+		iov.iov_len = sizeof (pid);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+			PRINT_ERROR("socketpair");
+			send(fd, &pid, sizeof (pid), MSG_NOSIGNAL);
+			continue;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			close(fd);
+			close(sv[0]);
+			helper_loop(sv[1], max_output);
+		} else if (pid < 0) {
+			PRINT_ERROR("fork");
+		} else {
+			msg.msg_control = cbuf;
+			msg.msg_controllen = sizeof (cbuf);
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+			memcpy(CMSG_DATA(cmsg), &sv[0], sizeof (int));
+		}
+
+		sendmsg(fd, &msg, MSG_NOSIGNAL);
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	/* the pool closed every helper's channel first, they are all going */
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	_exit(EXIT_SUCCESS);
+}
+
+static bool spawner_start(struct exec_pool *pool)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		PRINT_ERROR("socketpair");
+		return false;
+	}
+
+	pool->spawner_pid = fork();
+	switch (pool->spawner_pid) {
+	case -1:
+		PRINT_ERROR("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	case 0:
+		close(sv[0]);
+		spawner_loop(sv[1], pool->max_output);
+	}
+
+	close(sv[1]);
+	pool->spawner_fd = sv[0];
+	return true;
+}
+
+/* have the spawner fork a new helper for this slot; never forks the caller */
+static bool helper_start(struct exec_pool *pool, struct pool_helper *helper)
+{
+	char req = 0, cbuf[CMSG_SPACE(sizeof (int))];
+	struct iovec iov = { .iov_base = &helper->pid, .iov_len = sizeof (helper->pid) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof (cbuf);
+
+	pthread_mutex_lock(&pool->spawn_lock);
+	if (send(pool->spawner_fd, &req, sizeof (req), MSG_NOSIGNAL) != sizeof (req)) {
+		pthread_mutex_unlock(&pool->spawn_lock);
+		PRINT_ERROR("helper_start");
+		return false;
+	}
+	while ((n = recvmsg(pool->spawner_fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	pthread_mutex_unlock(&pool->spawn_lock);
+
+	cmsg = n == sizeof (helper->pid) ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		if (n >= 0)
+			errno = ECHILD;
+		PRINT_ERROR("helper_start");
+		return false;
+	}
+
+	memcpy(&helper->fd, CMSG_DATA(cmsg), sizeof (int));
+	helper->busy = false;
+	return true;
+}
+
+static void helper_stop(struct pool_helper *helper)
+{
+	if (helper->fd < 0)
+		return;
+
+	/* the helper sees EOF and exits, the spawner reaps it */
+	close(helper->fd);
+	helper->fd = -1;
+}
+
+/**
+ * Start @param helpers helper processes. Call this early, while the process
+ * is small: the helpers, and the spawner replacing those which die, are
+ * copies of it as it is now, and commands are spawned from them for the
+ * lifetime of the pool.
+ * @param max_output - bytes of stdout and of stderr kept per command, 0 for
+ *   no limit
+ */
+struct exec_pool *exec_pool_create(int helpers, size_t max_output)
+{
+	struct exec_pool *pool;
+
+	if (helpers < 1)
+		helpers = 1;
+
+	pool = calloc(1, sizeof (*pool) + helpers * sizeof (pool->helpers[0]));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pthread_mutex_init(&pool->spawn_lock, NULL);
+	pool->max_output = max_output;
+	pool->nr_helpers = helpers;
+	pool->spawner_fd = -1;
+	for (int i = 0; i < helpers; i++)
+		pool->helpers[i].fd = -1;
+
+	if (!spawner_start(pool)) {
+		exec_pool_destroy(pool);
+		return NULL;
+	}
+
+	for (int i = 0; i < helpers; i++) {
+		if (!helper_start(pool, &pool->helpers[i])) {
+			exec_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+static struct pool_helper *helper_get(struct exec_pool *pool)
+{
+	struct pool_helper *helper = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!helper) {
+		for (int i = 0; i < pool->nr_helpers; i++) {
+			if (!pool->helpers[i].busy) {
+				helper = &pool->helpers[i];
+				helper->busy = true;
+				break;
+			}
+		}
+		if (!helper)
+			pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return helper;
+}
+
+static void helper_put(struct exec_pool *pool, struct pool_helper *helper)
+{
+	pthread_mutex_lock(&pool->lock);
+	helper->busy = false;
+	pthread_cond_signal(&pool->idle);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Run @param argv, with argv[0] the full path to the command as for
+ * do_exec(), on the first idle helper, waiting for one if they are all
+ * busy. Safe to call from several threads at once.
+ * @return true if the command exited with status 0, the details and the
+ *   captured output are in @param res either way
+ */
+bool exec_pool_run(struct exec_pool *pool, char *const argv[], struct exec_result *res)
+{
+	struct pool_helper *helper;
+	struct pool_reply reply;
+	char req[POOL_MSG_MAX];
+	size_t len = 0;
+	bool ok = false;
+
+	memset(res, 0, sizeof (*res));
+	res->status = -1;
+
+	for (int i = 0; argv[i]; i++) {
+		size_t arg_len = strlen(argv[i]) + 1;
+
+		if (i == POOL_MAX_ARGS || len + arg_len > sizeof (req)) {
+			errno = E2BIG;
+			PRINT_ERROR("exec_pool_run");
+			return false;
+		}
+		memcpy(req + len, argv[i], arg_len);
+		len += arg_len;
+	}
+
+	helper = helper_get(pool);
+	if (send(helper->fd, req, len, MSG_NOSIGNAL) != (ssize_t)len ||
+	    recv(helper->fd, &reply, sizeof (reply), 0) != sizeof (reply))
+		goto broken;
+
+	res->out = malloc(reply.out_len + 1);
+	res->err = malloc(reply.err_len + 1);
+	if (!res->out || !res->err)
+		goto broken;
+
+	if (!recv_all(helper->fd, res->out, reply.out_len) ||
+	    !recv_all(helper->fd, res->err, reply.err_len))
+		goto broken;
+
+	res->out[reply.out_len] = '\0';
+	res->err[reply.err_len] = '\0';
+	res->out_len = reply.out_len;
+	res->err_len = reply.err_len;
+	res->status = reply.status;
+	res->truncated = reply.truncated;
+	ok = reply.status == 0;
+
+	helper_put(pool, helper);
+	return ok;
+
+broken:
+	/* the channel is out of sync or the helper died: start a new one */
+	PRINT_ERROR("exec_pool_run");
+	free(res->out);
+	free(res->err);
+	res->out = res->err = NULL;
+	helper_stop(helper);
+	helper_start(pool, helper);
+	helper_put(pool, helper);
+	return false;
+}
+
+void exec_pool_destroy(struct exec_pool *pool)
+{
+	if (!pool)
+		return;
+
+	for (int i = 0; i < pool->nr_helpers; i++)
+		helper_stop(&pool->helpers[i]);
+
+	/* and once it sees EOF too, the spawner waits for all of them */
+	if (pool->spawner_fd >= 0) {
+		close(pool->spawner_fd);
+		while (waitpid(pool->spawner_pid, NULL, 0) < 0 && errno == EINTR)
+			;
+	}
+
+	pthread_mutex_destroy(&pool->spawn_lock);
+	pthread_cond_destroy(&pool->idle);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
@@ -0,0 +1,21 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A pool of helper processes, forked while the caller is still small, which
+ * run commands on its behalf and send back their exit status and output.
+ */
+struct exec_pool;
+
+struct exec_result {
+	int status;		/* exit status, -1 if killed or not started */
+	char *out, *err;	/* NUL terminated, to be freed by the caller */
+	size_t out_len, err_len;
+	bool truncated;		/* output went past the pool's max_output */
+};
+
+struct exec_pool *exec_pool_create(int helpers, size_t max_output);
+
+bool exec_pool_run(struct exec_pool *pool, char *const argv[], struct exec_result *res);
+
+void exec_pool_destroy(struct exec_pool *pool);
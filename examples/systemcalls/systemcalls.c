@@ -4,18 +4,17 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include "systemcalls.h"
 
-#define PRINT_ERROR(msg)                                                   \
-	do {                                                               \
-		char *estr;                                                \
-		asprintf(&estr, "[%s:%d] %s: %s (%d)",                     \
-			 __FILE__, __LINE__, msg, strerror(errno), errno); \
-		fprintf(stderr, "%s\n", estr);                             \
-		fflush(stderr);                                            \
-		free(estr);                                                \
-	} while (0)
+#define EXEC_MAX_PARALLEL	256
+
+extern char **environ;
 
 /**
  * @param cmd the command to execute with system()
@@ -40,6 +39,57 @@ bool do_system(const char *cmd)
 	return true;
 }
 
+/*
+ * Start argv[0] with posix_spawn(), which glibc implements with
+ * clone(CLONE_VM|CLONE_VFORK): no page tables are copied, so the cost does
+ * not grow with the size of the calling process. out_fd and err_fd, unless
+ * -1, become the child's stdout and stderr. Descriptors we open are all
+ * O_CLOEXEC, so children spawned concurrently from other threads never
+ * inherit them.
+ */
+static pid_t spawn_command(char *const argv[], int out_fd, int err_fd)
+{
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int rc;
+
+	rc = posix_spawn_file_actions_init(&actions);
+	if (rc == 0 && out_fd >= 0)
+		rc = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	if (rc == 0 && err_fd >= 0)
+		rc = posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+	if (rc == 0)
+		rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc != 0) {
+		errno = rc;
+		PRINT_ERROR("posix_spawn");
+		return -1;
+	}
+
+	return pid;
+}
+
+/*
+ * Reap exactly the child we started, never somebody else's, and turn its
+ * wait status into an exit status: -1 when it was killed by a signal.
+ */
+static int wait_command(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			PRINT_ERROR("waitpid");
+			return -1;
+		}
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -81,32 +131,13 @@ bool do_exec(int count, ...)
  *   as second argument to the execv() command.
  *
 */
-	bool ret = true;
-	int status;
 	pid_t pid;
 
-	pid = fork();
-	switch (pid) {
-	case -1: /* fork() has failed */
-		PRINT_ERROR("fork");
-		ret = false;
-		break;
-	case 0:	 /* child of successful fork() */
-		if (execv(command[0], command) < 0) {
-			PRINT_ERROR("execv");
-			exit(EXIT_FAILURE);
-		}
-	}
-
-	if (ret && (wait(&status) == -1)) {
-		PRINT_ERROR("wait");
-		ret = false;
-	}
-
-	if (ret && WIFEXITED(status))
-		ret = !WEXITSTATUS(status);
+	pid = spawn_command(command, -1, -1);
+	if (pid < 0)
+		return false;
 
-	return ret;
+	return wait_command(pid) == 0;
 }
 
 /**
@@ -138,44 +169,360 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *   The rest of the behaviour is same as do_exec()
  *
 */
-	bool ret = true;
-	int fd, status;
+	int fd;
 	pid_t pid;
 
-	fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+	fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
 	if (fd < 0 ) {
 		PRINT_ERROR("open");
 		return false;
 	}
 
-	pid = fork();
-	switch (pid) {
-	case -1: /* fork() has failed */
-		PRINT_ERROR("fork");
-		ret = false;
-		break;
-	case 0:	 /* child of successful fork() */
-		if (dup2(fd, 1) < 0) {
-			PRINT_ERROR("dup2");
-			close(fd);
-			exit(EXIT_FAILURE);
+	pid = spawn_command(command, fd, -1);
+	close(fd);
+	if (pid < 0)
+		return false;
+
+	return wait_command(pid) == 0;
+}
+
+#ifdef SYS_pidfd_open
+static int pidfd_open(pid_t pid)
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+#else
+static int pidfd_open(pid_t pid)
+{
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+/*
+ * Wait for one of the nr running commands to finish and return its slot.
+ * With pidfds this is whichever finishes first; kernels without them fall
+ * back to waiting for the oldest one, which is still never a stray child.
+ */
+static int wait_any_command(struct exec_cmd *cmds, const int *slots,
+			    const pid_t *pids, struct pollfd *pfds, int nr)
+{
+	int i;
+
+	if (pfds[0].fd >= 0) {
+		while (poll(pfds, nr, -1) < 0) {
+			if (errno != EINTR) {
+				PRINT_ERROR("poll");
+				return -1;
+			}
+		}
+		for (i = 0; i < nr; i++) {
+			if (pfds[i].revents)
+				break;
 		}
+	} else {
+		i = 0;
+	}
+
+	cmds[slots[i]].status = wait_command(pids[i]);
+	return i;
+}
+
+/**
+ * Run every command in @param cmds, at most @param max_parallel of them at
+ * a time (and never more than EXEC_MAX_PARALLEL), and record each one's exit status in cmds[i].status (-1 if it
+ * could not be started or was killed by a signal).
+ * @return the number of commands which did not exit with status 0, or -1
+ *   if waiting for them failed, once those already running have finished
+ */
+int do_exec_many(struct exec_cmd *cmds, int count, int max_parallel)
+{
+	int i, done, running = 0, failed = 0;
+	bool use_pidfd = true;
+
+	/* the running set lives on the stack, so never size it past any use */
+	if (max_parallel > count)
+		max_parallel = count;
+	if (max_parallel > EXEC_MAX_PARALLEL)
+		max_parallel = EXEC_MAX_PARALLEL;
+	if (max_parallel < 1)
+		max_parallel = 1;
+
+	int slots[max_parallel];
+	pid_t pids[max_parallel];
+	struct pollfd pfds[max_parallel];
+
+	for (i = 0; i < count || running; ) {
+		if (i < count && running < max_parallel) {
+			pid_t pid = spawn_command(cmds[i].argv, -1, -1);
 
-		if (execv(command[0], command) < 0) {
-			PRINT_ERROR("execv");
-			exit(EXIT_FAILURE);
+			if (pid < 0) {
+				cmds[i++].status = -1;
+				failed++;
+				continue;
+			}
+
+			pfds[running].fd = use_pidfd ? pidfd_open(pid) : -1;
+			pfds[running].events = POLLIN;
+			if (pfds[running].fd < 0 && use_pidfd) {
+				/* no pidfds at all: reap in order from now on */
+				use_pidfd = false;
+				for (int j = 0; j < running; j++) {
+					close(pfds[j].fd);
+					pfds[j].fd = -1;
+				}
+			}
+			slots[running] = i++;
+			pids[running++] = pid;
+			continue;
 		}
+
+		done = wait_any_command(cmds, slots, pids, pfds, running);
+		if (done < 0)
+			goto out_reap;
+
+		if (cmds[slots[done]].status != 0)
+			failed++;
+		if (pfds[done].fd >= 0)
+			close(pfds[done].fd);
+
+		/* keep the running set packed */
+		running--;
+		memmove(&slots[done], &slots[done + 1], (running - done) * sizeof (*slots));
+		memmove(&pids[done], &pids[done + 1], (running - done) * sizeof (*pids));
+		memmove(&pfds[done], &pfds[done + 1], (running - done) * sizeof (*pfds));
 	}
 
-	close(fd);
+	return failed;
+
+out_reap:
+	/* leave no child nor pidfd behind, and start nothing more */
+	for (int j = 0; j < running; j++) {
+		if (pfds[j].fd >= 0)
+			close(pfds[j].fd);
+		cmds[slots[j]].status = wait_command(pids[j]);
+	}
+	while (i < count)
+		cmds[i++].status = -1;
+
+	return -1;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* append to a capture buffer, keeping it NUL terminated */
+static bool capture_append(char **buf, size_t *len, size_t *size, const char *data, size_t n)
+{
+	if (*len + n + 1 > *size) {
+		size_t nsize = *size ? *size : 4096;
+		char *nbuf;
+
+		while (nsize < *len + n + 1)
+			nsize *= 2;
+
+		nbuf = realloc(*buf, nsize);
+		if (!nbuf) {
+			PRINT_ERROR("realloc");
+			return false;
+		}
+		*buf = nbuf;
+		*size = nsize;
+	}
+
+	memcpy(*buf + *len, data, n);
+	*len += n;
+	(*buf)[*len] = '\0';
+	return true;
+}
+
+/*
+ * Wait, until timeout_ms after start, for the child to exit, leaving it to be
+ * reaped by wait_command(). False if it is still running by then.
+ */
+static bool wait_exit_until(pid_t pid, const struct timespec *start, int timeout_ms)
+{
+	int pidfd = pidfd_open(pid);
+	siginfo_t info;
+	long left;
+
+	for (;;) {
+		memset(&info, 0, sizeof (info));
+		if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;	/* wait_command() tells what went wrong */
+		}
+		if (info.si_pid == pid)
+			break;
+
+		left = timeout_ms - elapsed_ms(start);
+		if (left <= 0) {
+			if (pidfd >= 0)
+				close(pidfd);
+			return false;
+		}
+
+		/* without pidfds, check back every 10ms */
+		if (pidfd >= 0) {
+			struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+
+			poll(&pfd, 1, left);
+		} else {
+			struct timespec ts = { 0, (left < 10 ? left : 10) * 1000000L };
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	if (pidfd >= 0)
+		close(pidfd);
+	return true;
+}
+
+/**
+ * Run a command like do_exec(), with its stdout and stderr connected to
+ * pipes and gathered in memory: into cap->out and cap->err, which the
+ * caller frees, or handed to cap->chunk as they arrive when that is set.
+ * @param cap - see struct exec_capture; max_size, timeout_ms, chunk and arg
+ *   are inputs, everything else is filled in
+ * All other parameters, see do_exec above
+ * @return true if the command ran to completion and exited with status 0
+ */
+bool do_exec_capture(struct exec_capture *cap, int count, ...)
+{
+	va_list args;
+	char *command[count + 1];
+	int i;
+
+	va_start(args, count);
+	for (i = 0; i < count; i++)
+		command[i] = va_arg(args, char *);
+	command[count] = NULL;
+	va_end(args);
+
+	return do_execv_capture(cap, command);
+}
+
+/**
+ * do_exec_capture() taking a NULL terminated argument vector, as execv().
+ */
+bool do_execv_capture(struct exec_capture *cap, char *const command[])
+{
+	struct pollfd pfds[2];
+	size_t sizes[2] = { 0, 0 };
+	char **bufs[2] = { &cap->out, &cap->err };
+	size_t *lens[2] = { &cap->out_len, &cap->err_len };
+	int out[2], err[2], i;
+	struct timespec start;
+	bool stop = false;
+	char chunk[16384];
+	pid_t pid;
+
+	cap->out = cap->err = NULL;
+	cap->out_len = cap->err_len = 0;
+	cap->status = -1;
+	cap->truncated = cap->timed_out = false;
+
+	if (pipe2(out, O_CLOEXEC) < 0) {
+		PRINT_ERROR("pipe2");
+		return false;
+	}
+	if (pipe2(err, O_CLOEXEC) < 0) {
+		PRINT_ERROR("pipe2");
+		close(out[0]);
+		close(out[1]);
+		return false;
+	}
+
+	pid = spawn_command(command, out[1], err[1]);
+	close(out[1]);
+	close(err[1]);
+	if (pid < 0) {
+		close(out[0]);
+		close(err[0]);
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfds[0].fd = out[0];
+	pfds[1].fd = err[0];
+	pfds[0].events = pfds[1].events = POLLIN;
+
+	/* a closed stream gets a negative fd, which poll() skips */
+	while (!stop && (pfds[0].fd >= 0 || pfds[1].fd >= 0)) {
+		int timeout = -1, rc;
+
+		if (cap->timeout_ms > 0) {
+			timeout = cap->timeout_ms - elapsed_ms(&start);
+			if (timeout <= 0) {
+				cap->timed_out = true;
+				break;
+			}
+		}
+
+		rc = poll(pfds, 2, timeout);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			PRINT_ERROR("poll");
+			stop = true;
+			break;
+		}
+
+		for (i = 0; i < 2 && !stop; i++) {
+			ssize_t n;
+			size_t keep;
+
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+
+			n = read(pfds[i].fd, chunk, sizeof (chunk));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				continue;
+			}
+
+			/* past the cap, keep draining so the command is not blocked */
+			keep = n;
+			if (cap->max_size && *lens[i] + keep > cap->max_size) {
+				keep = cap->max_size - *lens[i];
+				cap->truncated = true;
+			}
+			if (!keep)
+				continue;
+
+			if (cap->chunk) {
+				*lens[i] += keep;
+				stop = cap->chunk(i ? STDERR_FILENO : STDOUT_FILENO, chunk, keep, cap->arg) != 0;
+			} else {
+				stop = !capture_append(bufs[i], lens[i], &sizes[i], chunk, keep);
+			}
+		}
+	}
+
+	/* a command may close its streams and keep running: hold it to the deadline */
+	if (!stop && !cap->timed_out && cap->timeout_ms > 0)
+		cap->timed_out = !wait_exit_until(pid, &start, cap->timeout_ms);
+
+	if (stop || cap->timed_out)
+		kill(pid, SIGKILL);
 
-	if (ret && (wait(&status) == -1)) {
-		PRINT_ERROR("wait");
-		ret = false;
+	for (i = 0; i < 2; i++) {
+		if (pfds[i].fd >= 0)
+			close(pfds[i].fd);
 	}
 
-	if (ret && WIFEXITED(status))
-		ret = !WEXITSTATUS(status);
+	cap->status = wait_command(pid);
 
-	return ret;
+	return !stop && !cap->timed_out && cap->status == 0;
 }
@@ -1,9 +1,47 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdarg.h>
 
+/* needs asprintf(), so _GNU_SOURCE defined before the first include */
+#define PRINT_ERROR(msg)                                                   \
+	do {                                                               \
+		char *estr;                                                \
+		asprintf(&estr, "[%s:%d] %s: %s (%d)",                     \
+			 __FILE__, __LINE__, msg, strerror(errno), errno); \
+		fprintf(stderr, "%s\n", estr);                             \
+		fflush(stderr);                                            \
+		free(estr);                                                \
+	} while (0)
+
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+struct exec_cmd {
+	char *const *argv;	/* full path of the command first, NULL terminated */
+	int status;		/* exit status, filled in by do_exec_many() */
+};
+
+int do_exec_many(struct exec_cmd *cmds, int count, int max_parallel);
+
+struct exec_capture {
+	size_t max_size;	/* bytes kept per stream, 0 for no limit */
+	int timeout_ms;		/* kill the command after this long, 0 for never */
+	/* when set, output goes here instead of out/err; non-zero stops it */
+	int (*chunk)(int stream, const char *buf, size_t len, void *arg);
+	void *arg;
+
+	char *out, *err;	/* NUL terminated, to be freed by the caller */
+	size_t out_len, err_len;
+	int status;		/* exit status, -1 if killed or not started */
+	bool truncated;		/* output went past max_size */
+	bool timed_out;
+};
+
+bool do_exec_capture(struct exec_capture *cap, int count, ...);
+bool do_execv_capture(struct exec_capture *cap, char *const command[]);
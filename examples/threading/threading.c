@@ -2,20 +2,34 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "lockstat.h"
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
 //#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
+static void sleep_ms(int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
 void* threadfunc(void* thread_param)
 {
 	struct thread_data *td = (struct thread_data *)thread_param;
 
-	usleep(td->wait_ms[TO_OBTAIN]);
+	sleep_ms(td->wait_ms[TO_OBTAIN]);
 	pthread_mutex_lock(td->lock);
 	td->thread_complete_success = true;
-	usleep(td->wait_ms[TO_RELEASE]);
+	sleep_ms(td->wait_ms[TO_RELEASE]);
 	pthread_mutex_unlock(td->lock);
 
 	return thread_param;
@@ -39,9 +53,371 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int
 
 	if (pthread_create(thread, NULL, threadfunc, td) != 0) {
 		ERROR_LOG("cannot create thread");
+		free(td);
 		return false;
 	}
 
 	return true;
 }
 
+/*
+ * The timer wheel: WHEEL_LEVELS levels of WHEEL_SIZE slots, level n slots
+ * being WHEEL_SIZE^n ticks wide. A task goes in the level its delay fits in,
+ * and is moved down a level each time the level above comes round to its
+ * slot, until it reaches level 0 and runs. Delays past the top level are
+ * parked in its furthest slot and re-filed from there.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define TICK_NS		1000000L	/* 1ms */
+
+struct sched_task {
+	struct sched_task *next;
+	uint64_t expires;		/* in ticks */
+	void (*fn)(void *);
+	void (*drop)(void *);		/* instead of fn, if never run */
+	void *arg;
+};
+
+struct timer_sched {
+	struct lockstat_mutex lock;
+	pthread_cond_t ready_cond;
+	struct sched_task *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+	struct sched_task *ready, **ready_tail;	/* due, waiting for a worker */
+	uint64_t now;			/* ticks elapsed while armed */
+	unsigned long pending;		/* tasks in the wheel */
+	bool armed;
+	bool stop;
+	int tfd;
+	pthread_t timer_thread;
+	int nr_workers;
+	pthread_t workers[];
+};
+
+static void timer_arm(struct timer_sched *sched, long interval_ns, long value_ns)
+{
+	struct itimerspec its = {
+		{ interval_ns / 1000000000L, interval_ns % 1000000000L },
+		{ value_ns / 1000000000L, value_ns % 1000000000L },
+	};
+
+	if (timerfd_settime(sched->tfd, 0, &its, NULL) < 0)
+		ERROR_LOG("timerfd_settime: %d", errno);
+}
+
+static void task_ready(struct timer_sched *sched, struct sched_task *task)
+{
+	task->next = NULL;
+	*sched->ready_tail = task;
+	sched->ready_tail = &task->next;
+	pthread_cond_signal(&sched->ready_cond);
+}
+
+/* file a task in the wheel, O(1); with sched->lock held */
+static void wheel_insert(struct timer_sched *sched, struct sched_task *task)
+{
+	uint64_t expires = task->expires;
+	uint64_t delta;
+	int level = 0;
+
+	if (expires <= sched->now) {
+		task_ready(sched, task);
+		return;
+	}
+
+	delta = expires - sched->now;
+	while (level < WHEEL_LEVELS - 1 &&
+	       delta >= (uint64_t)WHEEL_SIZE << (level * WHEEL_BITS))
+		level++;
+
+	if (delta >= (uint64_t)WHEEL_SIZE << (level * WHEEL_BITS))
+		expires = sched->now + ((uint64_t)WHEEL_SIZE << (level * WHEEL_BITS)) - 1;
+
+	expires = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	task->next = sched->wheel[level][expires];
+	sched->wheel[level][expires] = task;
+	sched->pending++;
+}
+
+/* advance the wheel by one tick; with sched->lock held */
+static void wheel_tick(struct timer_sched *sched)
+{
+	uint64_t now = ++sched->now;
+	struct sched_task *task, *next;
+
+	/* cascade the levels above which just came round to a new slot */
+	for (int level = 1; level < WHEEL_LEVELS; level++) {
+		struct sched_task **slot;
+
+		if (now & (((uint64_t)1 << (level * WHEEL_BITS)) - 1))
+			break;
+
+		slot = &sched->wheel[level][(now >> (level * WHEEL_BITS)) & WHEEL_MASK];
+		for (task = *slot, *slot = NULL; task; task = next) {
+			next = task->next;
+			sched->pending--;
+			wheel_insert(sched, task);
+		}
+	}
+
+	task = sched->wheel[0][now & WHEEL_MASK];
+	sched->wheel[0][now & WHEEL_MASK] = NULL;
+	for (; task; task = next) {
+		next = task->next;
+		sched->pending--;
+		task_ready(sched, task);
+	}
+}
+
+static void *timer_worker(void *arg)
+{
+	struct timer_sched *sched = arg;
+	uint64_t ticks;
+
+	for (;;) {
+		if (read(sched->tfd, &ticks, sizeof (ticks)) != sizeof (ticks)) {
+			if (errno == EINTR)
+				continue;
+			ERROR_LOG("timerfd read: %d", errno);
+			break;
+		}
+
+		lockstat_lock(&sched->lock);
+		if (sched->stop) {
+			lockstat_unlock(&sched->lock);
+			break;
+		}
+
+		/* a late wake up catches up on every tick it missed */
+		while (ticks-- && sched->pending)
+			wheel_tick(sched);
+
+		/* nothing left to wait for: stop ticking until the next task */
+		if (!sched->pending) {
+			timer_arm(sched, 0, 0);
+			sched->armed = false;
+		}
+		lockstat_unlock(&sched->lock);
+	}
+
+	return NULL;
+}
+
+static void *sched_worker(void *arg)
+{
+	struct timer_sched *sched = arg;
+	struct sched_task *task;
+
+	for (;;) {
+		lockstat_lock(&sched->lock);
+		while (!sched->ready && !sched->stop)
+			lockstat_cond_wait(&sched->ready_cond, &sched->lock);
+
+		task = sched->ready;
+		if (!task) {
+			lockstat_unlock(&sched->lock);
+			break;
+		}
+		sched->ready = task->next;
+		if (!sched->ready)
+			sched->ready_tail = &sched->ready;
+		lockstat_unlock(&sched->lock);
+
+		task->fn(task->arg);
+		free(task);
+	}
+
+	return NULL;
+}
+
+static bool sched_add(struct timer_sched *sched, unsigned int delay_ms,
+		      void (*fn)(void *), void (*drop)(void *), void *arg)
+{
+	struct sched_task *task;
+
+	task = malloc(sizeof (*task));
+	if (!task) {
+		ERROR_LOG("cannot allocate memory");
+		return false;
+	}
+
+	task->fn = fn;
+	task->drop = drop;
+	task->arg = arg;
+
+	lockstat_lock(&sched->lock);
+	/* a running timer is part way into the current tick: round it up */
+	task->expires = sched->now + delay_ms + (sched->armed && delay_ms);
+	wheel_insert(sched, task);
+	if (sched->pending && !sched->armed && !sched->stop) {
+		timer_arm(sched, TICK_NS, TICK_NS);
+		sched->armed = true;
+	}
+	lockstat_unlock(&sched->lock);
+
+	return true;
+}
+
+bool sched_after(struct timer_sched *sched, unsigned int delay_ms, void (*fn)(void *), void *arg)
+{
+	return sched_add(sched, delay_ms, fn, NULL, arg);
+}
+
+struct timer_sched *sched_create(int workers)
+{
+	struct timer_sched *sched;
+	int i;
+
+	if (workers < 1)
+		workers = 1;
+
+	sched = calloc(1, sizeof (*sched) + workers * sizeof (pthread_t));
+	if (!sched) {
+		ERROR_LOG("cannot allocate memory");
+		return NULL;
+	}
+
+	lockstat_mutex_init(&sched->lock, "timer_sched");
+	pthread_cond_init(&sched->ready_cond, NULL);
+	sched->ready_tail = &sched->ready;
+
+	sched->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (sched->tfd < 0) {
+		ERROR_LOG("timerfd_create: %d", errno);
+		goto fail_free;
+	}
+
+	if (pthread_create(&sched->timer_thread, NULL, timer_worker, sched) != 0) {
+		ERROR_LOG("cannot create thread");
+		goto fail_close;
+	}
+
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&sched->workers[i], NULL, sched_worker, sched) != 0) {
+			ERROR_LOG("cannot create thread");
+			break;
+		}
+		sched->nr_workers++;
+	}
+
+	if (!sched->nr_workers) {
+		sched_destroy(sched);
+		return NULL;
+	}
+
+	return sched;
+
+fail_close:
+	close(sched->tfd);
+fail_free:
+	free(sched);
+	return NULL;
+}
+
+void sched_destroy(struct timer_sched *sched)
+{
+	struct sched_task *task, *next;
+
+	lockstat_lock(&sched->lock);
+	sched->stop = true;
+	/* wake the timer thread up right away to notice */
+	timer_arm(sched, 0, 1);
+	pthread_cond_broadcast(&sched->ready_cond);
+	lockstat_unlock(&sched->lock);
+
+	pthread_join(sched->timer_thread, NULL);
+	for (int i = 0; i < sched->nr_workers; i++)
+		pthread_join(sched->workers[i], NULL);
+
+	/* tasks still in the wheel never came due */
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < WHEEL_SIZE; slot++) {
+			for (task = sched->wheel[level][slot]; task; task = next) {
+				next = task->next;
+				if (task->drop)
+					task->drop(task->arg);
+				free(task);
+			}
+		}
+	}
+
+	close(sched->tfd);
+	pthread_cond_destroy(&sched->ready_cond);
+	lockstat_mutex_destroy(&sched->lock);
+	free(sched);
+}
+
+struct mutex_task {
+	struct timer_sched *sched;
+	struct thread_data *td;
+	void (*done)(struct thread_data *td, void *arg);
+	void *arg;
+};
+
+static void mutex_task_drop(void *arg)
+{
+	struct mutex_task *mt = arg;
+
+	mt->done(mt->td, mt->arg);
+	free(mt);
+}
+
+/*
+ * A pthread mutex has to be released by the thread which locked it, so the
+ * hold is spent sleeping on the worker. Waiting for the lock is not: a busy
+ * mutex is retried on the next tick, so queued requests cost no thread.
+ */
+static void mutex_task_run(void *arg)
+{
+	struct mutex_task *mt = arg;
+	struct thread_data *td = mt->td;
+
+	if (pthread_mutex_trylock(td->lock) != 0) {
+		if (!sched_add(mt->sched, 1, mutex_task_run, mutex_task_drop, mt))
+			mutex_task_drop(mt);
+		return;
+	}
+
+	td->thread_complete_success = true;
+	sleep_ms(td->wait_ms[TO_RELEASE]);
+	pthread_mutex_unlock(td->lock);
+
+	mutex_task_drop(mt);
+}
+
+bool sched_obtaining_mutex(struct timer_sched *sched, pthread_mutex_t *mutex,
+			   int wait_to_obtain_ms, int wait_to_release_ms,
+			   void (*done)(struct thread_data *td, void *arg), void *arg)
+{
+	struct mutex_task *mt;
+	struct thread_data *td;
+
+	td = calloc(1, sizeof (*td));
+	mt = calloc(1, sizeof (*mt));
+	if (!td || !mt) {
+		ERROR_LOG("cannot allocate memory");
+		free(td);
+		free(mt);
+		return false;
+	}
+
+	td->thread_complete_success = false;
+	td->wait_ms[TO_OBTAIN]  = wait_to_obtain_ms;
+	td->wait_ms[TO_RELEASE] = wait_to_release_ms;
+	td->lock = mutex;
+
+	mt->sched = sched;
+	mt->td = td;
+	mt->done = done;
+	mt->arg = arg;
+
+	if (!sched_add(sched, wait_to_obtain_ms, mutex_task_run, mutex_task_drop, mt)) {
+		free(td);
+		free(mt);
+		return false;
+	}
+
+	return true;
+}
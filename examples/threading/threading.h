@@ -43,3 +43,39 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+
+/*
+ * Delayed task scheduler: a hierarchical timer wheel with 1ms ticks, driven
+ * by a single timerfd thread, which hands expired tasks to a small pool of
+ * worker threads. Scheduling a task is O(1) whatever its delay.
+ */
+struct timer_sched;
+
+struct timer_sched *sched_create(int workers);
+
+/**
+ * Run @param fn(@param arg) on one of the workers, @param delay_ms
+ * milliseconds from now.
+ * @return true if the task was queued, false if no memory was available.
+ */
+bool sched_after(struct timer_sched *sched, unsigned int delay_ms, void (*fn)(void *), void *arg);
+
+/**
+* The start_thread_obtaining_mutex() contract without a thread per request:
+* @param wait_to_obtain_ms from now a worker obtains @param mutex, holds it for
+* @param wait_to_release_ms milliseconds, then releases it. The thread_data
+* describing the request is dynamically allocated and handed to
+* @param done, along with @param arg, once the mutex has been released;
+* done is expected to free it, as the joiner does for a thread.
+* @return true if the request could be scheduled, false if a failure occurred.
+*/
+bool sched_obtaining_mutex(struct timer_sched *sched, pthread_mutex_t *mutex,
+			   int wait_to_obtain_ms, int wait_to_release_ms,
+			   void (*done)(struct thread_data *td, void *arg), void *arg);
+
+/**
+ * Stop the scheduler. Tasks already due are run first, the ones that are
+ * not are dropped without being run.
+ */
+void sched_destroy(struct timer_sched *sched);
@@ -0,0 +1,642 @@
+/*
+ * finder-index.c: on-disk trigram index for finder
+ *
+ * The index file is laid out as:
+ *
+ *	struct index_header
+ *	struct index_entry	entries[nr_files], sorted by device and inode
+ *	struct index_trigram	trigrams[nr_trigrams], sorted by trigram
+ *	postings		per trigram, the ids of the files holding it,
+ *				ascending, as LEB128 coded deltas
+ *
+ * A file's id is its position in entries[].
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "finder-index.h"
+
+#define INDEX_MAGIC	"FINDIDX1"
+#define NR_TRIGRAMS	(1U << 24)
+
+struct index_header {
+	char magic[8];
+	uint64_t nr_files;
+	uint64_t nr_trigrams;
+	uint64_t postings_size;
+};
+
+struct index_entry {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_ns;
+	uint64_t size;
+};
+
+struct index_trigram {
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t offset;	/* into postings */
+};
+
+struct index_record {
+	struct index_entry entry;
+	long old_id;		/* -1 if its trigrams were collected anew */
+	long new_id;
+	size_t first, count;	/* its trigrams, in the collector's */
+};
+
+struct finder_index {
+	void *map;
+	size_t map_size;
+	const struct index_header *header;
+	const struct index_entry *entries;
+	const struct index_trigram *trigrams;
+	const uint8_t *postings;
+	uint8_t *candidates;	/* bitmap of file ids, once selected */
+};
+
+static int64_t mtime_ns(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static void make_entry(struct index_entry *e, const struct stat *st)
+{
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->mtime_ns = mtime_ns(st);
+	e->size = st->st_size;
+}
+
+static int entry_cmp(const struct index_entry *a, const struct index_entry *b)
+{
+	if (a->dev != b->dev)
+		return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	return 0;
+}
+
+static const uint8_t *decode(const uint8_t *p, const uint8_t *end, uint64_t *val)
+{
+	int shift = 0;
+
+	*val = 0;
+	while (p < end && shift < 64) {
+		*val |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+static size_t encode(uint8_t *p, uint64_t val)
+{
+	size_t n = 0;
+
+	do {
+		p[n] = val & 0x7f;
+		val >>= 7;
+		if (val)
+			p[n] |= 0x80;
+		n++;
+	} while (val);
+
+	return n;
+}
+
+/*
+ * The file ids holding one trigram, at most nr_files of them as they strictly
+ * ascend, or -1 if the index is corrupt
+ */
+static long read_postings(const struct finder_index *idx, const struct index_trigram *t,
+			  uint32_t *ids)
+{
+	const uint8_t *p = idx->postings + t->offset;
+	const uint8_t *end = idx->postings + idx->header->postings_size;
+	uint64_t id = 0, delta;
+
+	if (t->count > idx->header->nr_files || t->offset >= idx->header->postings_size)
+		return -1;
+
+	for (uint32_t i = 0; i < t->count; i++) {
+		if (!(p = decode(p, end, &delta)) || (i && !delta))
+			return -1;
+		id += delta;
+		if (id < delta || id >= idx->header->nr_files)
+			return -1;
+		ids[i] = id;
+	}
+
+	return t->count;
+}
+
+static const struct index_trigram *find_trigram(const struct finder_index *idx,
+						uint32_t trigram)
+{
+	size_t lo = 0, hi = idx->header->nr_trigrams;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (idx->trigrams[mid].trigram == trigram)
+			return &idx->trigrams[mid];
+		if (idx->trigrams[mid].trigram < trigram)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+bool index_path(const char *dir, char **path)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	char real[PATH_MAX], *cache;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	if (!realpath(dir, real))
+		return false;
+
+	/* FNV-1a of the directory's real path names its index */
+	for (const char *p = real; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+
+	if (base && *base)
+		cache = strdup(base);
+	else if (asprintf(&cache, "%s/.cache", getenv("HOME") ? getenv("HOME") : "/tmp") < 0)
+		cache = NULL;
+	if (!cache)
+		return false;
+
+	mkdir(cache, 0755);
+	if (asprintf(path, "%s/finder-%016llx.idx", cache, (unsigned long long)hash) < 0) {
+		free(cache);
+		return false;
+	}
+
+	free(cache);
+	return true;
+}
+
+struct finder_index *index_open(const char *path)
+{
+	struct finder_index *idx;
+	const struct index_header *h;
+	struct stat st;
+	size_t need;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	idx = calloc(1, sizeof (*idx));
+	if (!idx || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof (*h))
+		goto out_free;
+
+	idx->map_size = st.st_size;
+	idx->map = mmap(NULL, idx->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (idx->map == MAP_FAILED)
+		goto out_free;
+
+	h = idx->header = idx->map;
+	if (memcmp(h->magic, INDEX_MAGIC, sizeof (h->magic)) ||
+	    h->nr_files > LONG_MAX / sizeof (struct index_entry) ||
+	    h->nr_trigrams > NR_TRIGRAMS)
+		goto out_unmap;
+
+	need = sizeof (*h) + h->nr_files * sizeof (struct index_entry) +
+	       h->nr_trigrams * sizeof (struct index_trigram);
+	if (need > idx->map_size || h->postings_size != idx->map_size - need)
+		goto out_unmap;
+
+	idx->entries = (const struct index_entry *)(h + 1);
+	idx->trigrams = (const struct index_trigram *)(idx->entries + h->nr_files);
+	idx->postings = (const uint8_t *)(idx->trigrams + h->nr_trigrams);
+
+	/* postings are decoded into arrays sized after nr_files, trust no count */
+	for (uint64_t i = 0; i < h->nr_trigrams; i++) {
+		const struct index_trigram *t = &idx->trigrams[i];
+
+		if (!t->count || t->count > h->nr_files || t->offset >= h->postings_size ||
+		    t->trigram >= NR_TRIGRAMS ||
+		    (i && t->trigram <= idx->trigrams[i - 1].trigram))
+			goto out_unmap;
+	}
+	close(fd);
+
+	return idx;
+
+out_unmap:
+	munmap(idx->map, idx->map_size);
+out_free:
+	free(idx);
+	close(fd);
+	return NULL;
+}
+
+void index_close(struct finder_index *idx)
+{
+	if (!idx)
+		return;
+
+	munmap(idx->map, idx->map_size);
+	free(idx->candidates);
+	free(idx);
+}
+
+bool index_select(struct finder_index *idx, const char *needle, size_t len)
+{
+	uint32_t *ids = NULL, *next = NULL;
+	long nr = -1;
+	bool ok = false;
+
+	/* no trigrams in it, or some spanning lines: nothing to narrow down by */
+	if (len < 3 || memchr(needle, '\n', len))
+		return false;
+
+	idx->candidates = calloc(idx->header->nr_files / 8 + 1, 1);
+	ids = malloc((idx->header->nr_files + 1) * sizeof (*ids));
+	next = malloc((idx->header->nr_files + 1) * sizeof (*next));
+	if (!idx->candidates || !ids || !next)
+		goto out;
+
+	for (size_t i = 0; i + 3 <= len; i++) {
+		const uint8_t *p = (const uint8_t *)needle + i;
+		const struct index_trigram *t = find_trigram(idx, p[0] << 16 | p[1] << 8 | p[2]);
+		long nr_next, j = 0, k = 0, out = 0;
+
+		/* no indexed file holds this one, so none can hold needle */
+		if (!t) {
+			nr = 0;
+			break;
+		}
+
+		if ((nr_next = read_postings(idx, t, nr < 0 ? ids : next)) < 0)
+			goto out;
+
+		if (nr < 0) {
+			nr = nr_next;
+			continue;
+		}
+
+		while (j < nr && k < nr_next) {
+			if (ids[j] == next[k]) {
+				ids[out++] = ids[j];
+				j++, k++;
+			} else if (ids[j] < next[k]) {
+				j++;
+			} else {
+				k++;
+			}
+		}
+		nr = out;
+	}
+
+	for (long i = 0; i < nr; i++)
+		idx->candidates[ids[i] / 8] |= 1 << (ids[i] % 8);
+	ok = true;
+out:
+	if (!ok) {
+		free(idx->candidates);
+		idx->candidates = NULL;
+	}
+	free(ids);
+	free(next);
+
+	return ok;
+}
+
+long index_lookup(struct finder_index *idx, const struct stat *st)
+{
+	size_t lo = 0, hi = idx->header->nr_files;
+	struct index_entry key;
+
+	make_entry(&key, st);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = entry_cmp(&key, &idx->entries[mid]);
+
+		if (!cmp) {
+			if (idx->entries[mid].mtime_ns != key.mtime_ns ||
+			    idx->entries[mid].size != key.size)
+				return -1;
+			return mid;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+bool index_candidate(struct finder_index *idx, long id)
+{
+	return !idx->candidates || (idx->candidates[id / 8] & (1 << (id % 8)));
+}
+
+int index_collector_init(struct index_collector *c)
+{
+	memset(c, 0, sizeof (*c));
+	c->seen = calloc(NR_TRIGRAMS / 8, 1);
+
+	return c->seen ? 0 : -ENOMEM;
+}
+
+void index_collector_free(struct index_collector *c)
+{
+	free(c->records);
+	free(c->trigrams);
+	free(c->seen);
+}
+
+static struct index_record *add_record(struct index_collector *c, const struct stat *st,
+				       long old_id)
+{
+	struct index_record *r;
+
+	if (c->nr_records == c->max_records) {
+		size_t max = c->max_records ? c->max_records * 2 : 1024;
+		struct index_record *records = realloc(c->records, max * sizeof (*records));
+
+		if (!records)
+			return NULL;
+		c->records = records;
+		c->max_records = max;
+	}
+
+	r = &c->records[c->nr_records++];
+	make_entry(&r->entry, st);
+	r->old_id = old_id;
+	r->first = c->nr_trigrams;
+	r->count = 0;
+
+	return r;
+}
+
+int index_collect_old(struct index_collector *c, const struct stat *st, long id)
+{
+	return add_record(c, st, id) ? 0 : -ENOMEM;
+}
+
+int index_collect_new(struct index_collector *c, const struct stat *st)
+{
+	c->current = add_record(c, st, -1);
+	c->trigram = 0;
+	c->run = 0;
+
+	return c->current ? 0 : -ENOMEM;
+}
+
+void index_collect_data(struct index_collector *c, const char *buf, size_t len)
+{
+	for (size_t i = 0; i < len && c->current; i++) {
+		uint32_t t;
+
+		if (buf[i] == '\n') {
+			c->run = 0;
+			continue;
+		}
+
+		t = c->trigram = (c->trigram << 8 | (uint8_t)buf[i]) & (NR_TRIGRAMS - 1);
+		if (++c->run < 3 || (c->seen[t / 8] & (1 << (t % 8))))
+			continue;
+
+		if (c->nr_trigrams == c->max_trigrams) {
+			size_t max = c->max_trigrams ? c->max_trigrams * 2 : 65536;
+			uint32_t *trigrams = realloc(c->trigrams, max * sizeof (*trigrams));
+
+			/* losing a trigram would lose matches: leave the file out instead */
+			if (!trigrams) {
+				c->current->entry.size = UINT64_MAX;
+				index_collect_end(c);
+				break;
+			}
+			c->trigrams = trigrams;
+			c->max_trigrams = max;
+		}
+
+		c->seen[t / 8] |= 1 << (t % 8);
+		c->trigrams[c->nr_trigrams++] = t;
+	}
+}
+
+void index_collect_end(struct index_collector *c)
+{
+	struct index_record *r = c->current;
+
+	if (!r)
+		return;
+
+	r->count = c->nr_trigrams - r->first;
+	for (size_t i = r->first; i < c->nr_trigrams; i++)
+		c->seen[c->trigrams[i] / 8] &= ~(1 << (c->trigrams[i] % 8));
+	c->current = NULL;
+}
+
+struct record_ref {
+	struct index_record *record;
+	const struct index_collector *collector;
+};
+
+static int record_cmp(const void *a, const void *b)
+{
+	const struct record_ref *ra = a, *rb = b;
+
+	return entry_cmp(&ra->record->entry, &rb->record->entry);
+}
+
+/*
+ * Postings come from the files collected anew and from those carried over
+ * from the previous index. Both are bucketed by trigram in ascending file id
+ * order, the new ones by walking the files in id order, the old ones because
+ * old and new ids follow the same device and inode order, and are merged
+ * into the new postings one trigram at a time.
+ */
+int index_write(const char *path, struct finder_index *old,
+		struct index_collector *c, int nr_collectors)
+{
+	struct record_ref *sorted = NULL;
+	struct index_entry *entries = NULL;
+	struct index_trigram *trigrams = NULL;
+	struct index_header header;
+	uint32_t *bucket = NULL, *fresh = NULL, *carried = NULL;
+	uint8_t *postings = NULL;
+	long *old_to_new = NULL;
+	size_t nr_records = 0, nr_fresh = 0, nr_files = 0, nr_trigrams = 0, size = 0;
+	size_t i, n, pos, old_t = 0, max_carried = 0;
+	char *tmp = NULL;
+	FILE *f = NULL;
+	int rc = -ENOMEM;
+
+	for (int k = 0; k < nr_collectors; k++) {
+		nr_records += c[k].nr_records;
+		nr_fresh += c[k].nr_trigrams;
+	}
+
+	sorted = malloc((nr_records + 1) * sizeof (*sorted));
+	entries = malloc((nr_records + 1) * sizeof (*entries));
+	bucket = calloc(NR_TRIGRAMS + 1, sizeof (*bucket));
+	fresh = malloc((nr_fresh + 1) * sizeof (*fresh));
+	if (old) {
+		old_to_new = malloc((old->header->nr_files + 1) * sizeof (*old_to_new));
+		max_carried = old->header->nr_files;
+		carried = malloc((max_carried + 1) * sizeof (*carried));
+	}
+	if (!sorted || !entries || !bucket || !fresh || (old && (!old_to_new || !carried)))
+		goto out;
+
+	/* the same file met twice, through links, is indexed once */
+	n = 0;
+	for (int k = 0; k < nr_collectors; k++) {
+		for (i = 0; i < c[k].nr_records; i++) {
+			sorted[n].record = &c[k].records[i];
+			sorted[n++].collector = &c[k];
+		}
+	}
+	qsort(sorted, nr_records, sizeof (*sorted), record_cmp);
+	for (i = 0; i < nr_records; i++) {
+		struct index_record *r = sorted[i].record;
+
+		if (nr_files && !entry_cmp(&r->entry, &entries[nr_files - 1])) {
+			r->new_id = nr_files - 1;
+			continue;
+		}
+		r->new_id = nr_files;
+		entries[nr_files++] = r->entry;
+	}
+
+	/* counting sort of the fresh trigrams, in file id order */
+	for (int k = 0; k < nr_collectors; k++) {
+		for (i = 0; i < c[k].nr_trigrams; i++)
+			bucket[c[k].trigrams[i] + 1]++;
+	}
+	for (i = 1; i <= NR_TRIGRAMS; i++)
+		bucket[i] += bucket[i - 1];
+	for (i = 0; i < nr_records; i++) {
+		const struct index_record *r = sorted[i].record;
+		const uint32_t *t = sorted[i].collector->trigrams + r->first;
+
+		for (n = 0; n < r->count; n++)
+			fresh[bucket[t[n]]++] = r->new_id;
+	}
+	/* bucket[t] now ends trigram t, and so starts t + 1 */
+
+	if (old) {
+		for (i = 0; i < old->header->nr_files; i++)
+			old_to_new[i] = -1;
+		for (i = 0; i < nr_records; i++) {
+			const struct index_record *r = sorted[i].record;
+
+			if (r->old_id >= 0 && (size_t)r->old_id < old->header->nr_files)
+				old_to_new[r->old_id] = r->new_id;
+		}
+	}
+
+	n = old ? old->header->nr_trigrams : 0;
+	trigrams = malloc((NR_TRIGRAMS < nr_fresh + n ? NR_TRIGRAMS : nr_fresh + n) *
+			  sizeof (*trigrams) + 1);
+	postings = malloc((nr_fresh + (old ? old->header->postings_size : 0)) * 5 + 1);
+	if (!trigrams || !postings)
+		goto out;
+
+	for (pos = 0, i = 0; i < NR_TRIGRAMS; i++) {
+		size_t end = bucket[i], nr_carried = 0, j = pos, k = 0;
+		struct index_trigram *t;
+		uint32_t prev = 0;
+		bool first = true;
+
+		while (old_t < n && old->trigrams[old_t].trigram < i)
+			old_t++;
+		if (old_t < n && old->trigrams[old_t].trigram == i) {
+			long count = read_postings(old, &old->trigrams[old_t], carried);
+
+			for (long m = 0; m < count; m++) {
+				if (old_to_new[carried[m]] >= 0)
+					carried[nr_carried++] = old_to_new[carried[m]];
+			}
+		}
+
+		if (pos == end && !nr_carried)
+			continue;
+
+		t = &trigrams[nr_trigrams++];
+		t->trigram = i;
+		t->count = 0;
+		t->offset = size;
+		while (j < end || k < nr_carried) {
+			uint32_t id;
+
+			if (k == nr_carried || (j < end && fresh[j] < carried[k]))
+				id = fresh[j++];
+			else
+				id = carried[k++];
+
+			if (!first && id == prev)
+				continue;
+			size += encode(postings + size, id - prev);
+			t->count++;
+			prev = id;
+			first = false;
+		}
+		pos = end;
+	}
+
+	memset(&header, 0, sizeof (header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof (header.magic));
+	header.nr_files = nr_files;
+	header.nr_trigrams = nr_trigrams;
+	header.postings_size = size;
+
+	if (asprintf(&tmp, "%s.%d", path, (int)getpid()) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	if (!(f = fopen(tmp, "w")) ||
+	    fwrite(&header, sizeof (header), 1, f) != 1 ||
+	    fwrite(entries, sizeof (*entries), nr_files, f) != nr_files ||
+	    fwrite(trigrams, sizeof (*trigrams), nr_trigrams, f) != nr_trigrams ||
+	    fwrite(postings, 1, size, f) != size ||
+	    fflush(f) || fsync(fileno(f))) {
+		rc = -errno;
+		goto out;
+	}
+
+	/* readers see either the previous index or this one, whole */
+	if (rename(tmp, path) < 0) {
+		rc = -errno;
+		goto out;
+	}
+	rc = 0;
+out:
+	if (f)
+		fclose(f);
+	if (rc && tmp)
+		unlink(tmp);
+	free(tmp);
+	free(sorted);
+	free(entries);
+	free(bucket);
+	free(fresh);
+	free(carried);
+	free(old_to_new);
+	free(trigrams);
+	free(postings);
+
+	return rc;
+}
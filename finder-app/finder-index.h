@@ -0,0 +1,58 @@
+/*
+ * finder-index.h: on-disk trigram index for finder
+ *
+ * Maps every three byte sequence not crossing a line break to the files
+ * holding it, for files identified by device, inode, modification time and
+ * size. A search can then skip every indexed file, still unchanged, which
+ * cannot hold all the trigrams of the search string; files new or changed
+ * since the index was written are searched as usual.
+ */
+#ifndef _FINDER_INDEX_H_
+#define _FINDER_INDEX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+struct finder_index;
+
+/* what a worker thread gathered for the next index, while searching */
+struct index_collector {
+	struct index_record *records;
+	size_t nr_records, max_records;
+	uint32_t *trigrams;		/* of each file, one after the other */
+	size_t nr_trigrams, max_trigrams;
+	struct index_record *current;	/* file being collected */
+	uint8_t *seen;			/* trigrams of the current file */
+	uint32_t trigram;
+	int run;			/* bytes since the last line break */
+};
+
+/* where the index of a directory lives, in *path; false if it cannot tell */
+bool index_path(const char *dir, char **path);
+
+/* map the index at path; NULL if there is none, or not a valid one */
+struct finder_index *index_open(const char *path);
+void index_close(struct finder_index *idx);
+
+/* narrow the files to search down to those which can hold needle */
+bool index_select(struct finder_index *idx, const char *needle, size_t len);
+/* the file's id in the index, or -1 if it is not in there as it is now */
+long index_lookup(struct finder_index *idx, const struct stat *st);
+bool index_candidate(struct finder_index *idx, long id);
+
+int index_collector_init(struct index_collector *c);
+void index_collector_free(struct index_collector *c);
+/* keep an unchanged file's trigrams from the current index */
+int index_collect_old(struct index_collector *c, const struct stat *st, long id);
+/* gather a file's trigrams from its contents, fed in order */
+int index_collect_new(struct index_collector *c, const struct stat *st);
+void index_collect_data(struct index_collector *c, const char *buf, size_t len);
+void index_collect_end(struct index_collector *c);
+
+/* write what the collectors gathered as the new index at path */
+int index_write(const char *path, struct finder_index *old,
+		struct index_collector *c, int nr_collectors);
+
+#endif /* _FINDER_INDEX_H_ */
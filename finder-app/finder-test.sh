@@ -15,6 +15,223 @@ if [ -d "/etc/finder-app/conf" ]; then
 	CONFBASE="/etc/finder-app/"
 fi
 
+# Benchmark mode, see bench_usage below. Nothing past this block is involved.
+bench_usage()
+{
+	echo "Usage: $0 --bench [options]"
+	echo "    --files <N[,N...]>     corpus sizes, in files (default: 10,1000,10000)"
+	echo "    --depth <D>            directory levels (default: 2)"
+	echo "    --fanout <F>           subdirectories per level (default: 10)"
+	echo "    --size <bytes>[k|m]    size of each file (default: 4k)"
+	echo "    --density <percent>    files holding the string (default: 10)"
+	echo "    --string <S>           string to search for (default: ${WRITESTR})"
+	echo "    --loop-max <N>         largest corpus to also run one writer per file"
+	echo "                           and the finder.sh shell fallback on (default: 1000)"
+	echo "    --format <csv|json>    result format (default: csv)"
+	echo "    --output <file>        write results to file instead of stdout"
+	exit 1
+}
+
+now_ns()
+{
+	t=$(date +%s%N)
+	t=$(echo "${t}" | tr -cd '0-9')
+	# no %N support: second resolution it is
+	if [ ${#t} -le 10 ]; then
+		t=$((t * 1000000000))
+	fi
+	echo "${t}"
+}
+
+# drop the page cache, if allowed to, for the cold runs
+drop_caches()
+{
+	sync
+	if [ -w /proc/sys/vm/drop_caches ] && echo 3 > /proc/sys/vm/drop_caches 2>/dev/null; then
+		return 0
+	fi
+	return 1
+}
+
+# bench_emit <phase> <cache> <start ns> <end ns> <files> <bytes> <result>
+bench_emit()
+{
+	awk -v fmt="${B_FORMAT}" -v n="${B_N}" -v depth="${B_DEPTH}" -v fanout="${B_FANOUT}" \
+	    -v size="${B_SIZE}" -v density="${B_DENSITY}" -v phase="$1" -v cache="$2" \
+	    -v ns="$(($4 - $3))" -v files="$5" -v bytes="$6" -v result="$7" 'BEGIN {
+		secs = ns / 1e9
+		fps = secs > 0 ? files / secs : 0
+		mbps = secs > 0 ? bytes / secs / 1e6 : 0
+		if (fmt == "json")
+			printf "{\"files\":%d,\"depth\":%d,\"fanout\":%d,\"size\":%d,\"density\":%d," \
+			       "\"phase\":\"%s\",\"cache\":\"%s\",\"seconds\":%.6f," \
+			       "\"files_per_s\":%.1f,\"mb_per_s\":%.2f,\"result\":\"%s\"}\n",
+			       n, depth, fanout, size, density, phase, cache, secs, fps, mbps, result
+		else
+			printf "%d,%d,%d,%d,%d,%s,%s,%.6f,%.1f,%.2f,%s\n",
+			       n, depth, fanout, size, density, phase, cache, secs, fps, mbps, result
+	}' >> "${B_RESULTS}"
+}
+
+# bench_find <phase> <cache> <finder command...>
+bench_find()
+{
+	phase=$1
+	cache=$2
+	shift 2
+	start=$(now_ns)
+	out=$("$@" "${B_CORPUS}" "${B_STRING}" 2>/dev/null)
+	end=$(now_ns)
+	result=mismatch
+	if [ "${out}" = "${B_EXPECT}" ]; then
+		result=ok
+	fi
+	bench_emit "${phase}" "${cache}" "${start}" "${end}" "${B_N}" "${B_BYTES}" "${result}"
+}
+
+bench()
+{
+	B_FILES=10,1000,10000
+	B_DEPTH=2
+	B_FANOUT=10
+	B_SIZE=4k
+	B_DENSITY=10
+	B_STRING=${WRITESTR}
+	B_LOOP_MAX=1000
+	B_FORMAT=csv
+	B_OUTPUT=
+
+	while [ $# -gt 0 ]; do
+		if [ $# -lt 2 ]; then
+			bench_usage
+		fi
+		case "$1" in
+		--files)	B_FILES=$2 ;;
+		--depth)	B_DEPTH=$2 ;;
+		--fanout)	B_FANOUT=$2 ;;
+		--size)		B_SIZE=$2 ;;
+		--density)	B_DENSITY=$2 ;;
+		--string)	B_STRING=$2 ;;
+		--loop-max)	B_LOOP_MAX=$2 ;;
+		--format)	B_FORMAT=$2 ;;
+		--output)	B_OUTPUT=$2 ;;
+		*)		bench_usage ;;
+		esac
+		shift 2
+	done
+
+	case "${B_SIZE}" in
+	*k|*K)	B_SIZE=$((${B_SIZE%?} * 1024)) ;;
+	*m|*M)	B_SIZE=$((${B_SIZE%?} * 1024 * 1024)) ;;
+	esac
+
+	if [ ! -x "${SCRIPTPATH}/writer" ] || [ ! -x "${SCRIPTPATH}/finder" ]; then
+		echo "ERROR: build writer and finder first (make -C ${SCRIPTPATH})"
+		exit 1
+	fi
+
+	B_DIR=${WRITEDIR}/bench
+	B_CORPUS=${B_DIR}/corpus
+	B_RESULTS=${B_DIR}/results
+	rm -rf "${B_DIR}"
+	mkdir -p "${B_DIR}/sh" "${B_DIR}/cache"
+	trap 'rm -rf "${B_DIR}"' EXIT
+	: > "${B_RESULTS}"
+
+	# a copy of finder.sh with no finder binary to hand over to
+	cp "${SCRIPTPATH}/finder.sh" "${B_DIR}/sh/finder.sh"
+
+	for B_N in $(echo "${B_FILES}" | tr ',' ' '); do
+		rm -rf "${B_CORPUS}"
+
+		# the manifest, and the counts finder must come up with
+		B_TOTALS=$(awk -v n="${B_N}" -v depth="${B_DEPTH}" -v fanout="${B_FANOUT}" \
+			       -v size="${B_SIZE}" -v density="${B_DENSITY}" -v str="${B_STRING}" \
+			       -v corpus="${B_CORPUS}" -v manifest="${B_DIR}/manifest" 'BEGIN {
+			hit = "line with " str " in it"
+			miss = "a filler line without it"
+			len = length(hit) + 1
+			per_file = int(size / len) + (size % len >= 10 + length(str))
+			for (i = 0; i < n; i++) {
+				path = corpus
+				x = i
+				for (k = 0; k < depth; k++) {
+					path = path "/d" (x % fanout)
+					x = int(x / fanout)
+				}
+				if (i % 100 < density) {
+					printf "%s/f%d\t@%d:%s\\n\n", path, i, size, hit > manifest
+					lines += per_file
+				} else {
+					printf "%s/f%d\t@%d:%s\\n\n", path, i, size, miss > manifest
+				}
+			}
+			printf "%d %d\n", lines, n * size
+		}')
+		B_LINES=${B_TOTALS% *}
+		B_BYTES=${B_TOTALS#* }
+		B_EXPECT="The number of files are ${B_N} and the number of matching lines are ${B_LINES}"
+
+		if [ "${B_N}" -le "${B_LOOP_MAX}" ]; then
+			awk -F '\t' '{ sub("/[^/]*$", "", $1); print $1 }' "${B_DIR}/manifest" | \
+				sort -u | xargs mkdir -p
+			start=$(now_ns)
+			while IFS='	' read -r path content; do
+				"${SCRIPTPATH}/writer" "${path}" "${B_STRING}" 2>/dev/null
+			done < "${B_DIR}/manifest"
+			end=$(now_ns)
+			bench_emit write-loop warm "${start}" "${end}" "${B_N}" \
+				$((B_N * (${#B_STRING} + 1))) ok
+			rm -rf "${B_CORPUS}"
+		fi
+
+		start=$(now_ns)
+		result=ok
+		"${SCRIPTPATH}/writer" --batch "${B_DIR}/manifest" > /dev/null 2>&1 || result=failed
+		end=$(now_ns)
+		bench_emit write-batch warm "${start}" "${end}" "${B_N}" "${B_BYTES}" "${result}"
+
+		if drop_caches; then
+			bench_find finder cold "${SCRIPTPATH}/finder"
+		fi
+		bench_find finder warm "${SCRIPTPATH}/finder"
+
+		XDG_CACHE_HOME=${B_DIR}/cache
+		export XDG_CACHE_HOME
+		bench_find finder-index-build warm "${SCRIPTPATH}/finder" --index
+		if drop_caches; then
+			bench_find finder-indexed cold "${SCRIPTPATH}/finder"
+		fi
+		bench_find finder-indexed warm "${SCRIPTPATH}/finder"
+		unset XDG_CACHE_HOME
+
+		if [ "${B_N}" -le "${B_LOOP_MAX}" ]; then
+			bench_find finder.sh warm sh "${B_DIR}/sh/finder.sh"
+		fi
+
+		rm -rf "${B_CORPUS}" "${B_DIR}/cache"/*
+	done
+
+	{
+		if [ "${B_FORMAT}" = "json" ]; then
+			echo "["
+			sed '$!s/$/,/' "${B_RESULTS}"
+			echo "]"
+		else
+			echo "files,depth,fanout,size,density,phase,cache,seconds,files_per_s,mb_per_s,result"
+			cat "${B_RESULTS}"
+		fi
+	} > "${B_OUTPUT:-/dev/stdout}"
+
+	! grep -q -e mismatch -e failed "${B_RESULTS}"
+}
+
+if [ "${1:-}" = "--bench" ]; then
+	shift
+	bench "$@"
+	exit $?
+fi
+
 username=$(cat ${CONFBASE}conf/username.txt)
 
 if [ $# -lt 3 ]
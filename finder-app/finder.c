@@ -0,0 +1,733 @@
+/*
+ * finder.c: native re-implementation of finder.sh
+ *
+ * Counts the regular files under a directory, following symbolic links like
+ * find -L does, and the lines in them matching a string like grep does, and
+ * prints both the same way finder.sh does.
+ *
+ * Directories are walked with openat()/getdents64() by a pool of threads,
+ * each keeping a deque of pending work and stealing from the others once its
+ * own runs dry. Files are streamed through a fixed size buffer per thread,
+ * and searched for plain strings with a vectorized substring search; patterns
+ * using any basic regular expression syntax go through regexec() instead,
+ * which needs whole lines, so those are read with getline() and a file with
+ * no newlines in it is held in memory entirely.
+ *
+ * With --index, the trigrams of the files searched are saved into an index
+ * kept for the directory under $XDG_CACHE_HOME, or ~/.cache. Once there is
+ * one, searches only read the files which changed since it was written or
+ * which hold every trigram of the search string; --index again brings it up
+ * to date, collecting only from files it does not know as they are now.
+ *
+ * Usage: finder [-j threads] [--index] <FILES-DIR> <STRING-TO-SEARCH>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "finder-index.h"
+
+#define MAX_THREADS	64
+#define READ_SIZE	(256 * 1024)	/* file buffer, per thread */
+#define DENTS_SIZE	(64 * 1024)
+#define CHUNK_FILES	256		/* files handed out as one work item */
+#define CHUNK_NAMES	(16 * 1024)
+#define REGEX_CHARS	".[]*^$\\\n"
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* the directories a path went through, to tell a symlink loop */
+struct ancestry {
+	unsigned long refs;
+	dev_t dev;
+	ino_t ino;
+	struct ancestry *parent;
+};
+
+/* an open directory, shared by the file chunks read from it */
+struct dir_ref {
+	unsigned long refs;
+	int fd;
+	char path[];
+};
+
+enum work_type { WORK_DIR, WORK_FILES };
+
+struct work {
+	struct work *next, *prev;
+	enum work_type type;
+	struct {
+		struct ancestry *parent;
+		char *path;
+	} dir;
+	struct {
+		struct dir_ref *dir;
+		int count;
+		size_t used;
+		char *names;
+	} files;
+};
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct work *head, *tail;	/* owner works the tail, thieves the head */
+	unsigned long queued;
+	unsigned long files;
+	unsigned long lines;
+	char *buf;
+	struct index_collector index;
+};
+
+static const char *needle;
+static size_t needle_len;
+static bool use_regex;
+static regex_t regex;
+
+static struct finder_index *index_map;
+static bool index_build;
+static bool index_narrowed;		/* by the search string's trigrams */
+
+static struct worker workers[MAX_THREADS];
+static int nr_workers = 1;
+static unsigned long pending;		/* work items queued or running */
+static unsigned long sleepers;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void push_work(struct worker *w, struct work *work)
+{
+	__atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&w->lock);
+	work->next = NULL;
+	work->prev = w->tail;
+	if (w->tail)
+		w->tail->next = work;
+	else
+		w->head = work;
+	w->tail = work;
+	__atomic_add_fetch(&w->queued, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&w->lock);
+
+	if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&idle_lock);
+		pthread_cond_signal(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+static struct work *pop_work(struct worker *w, bool steal)
+{
+	struct work *work;
+
+	if (!__atomic_load_n(&w->queued, __ATOMIC_SEQ_CST))
+		return NULL;
+
+	pthread_mutex_lock(&w->lock);
+	work = steal ? w->head : w->tail;
+	if (work) {
+		if (steal) {
+			w->head = work->next;
+			if (w->head)
+				w->head->prev = NULL;
+			else
+				w->tail = NULL;
+		} else {
+			w->tail = work->prev;
+			if (w->tail)
+				w->tail->next = NULL;
+			else
+				w->head = NULL;
+		}
+		__atomic_sub_fetch(&w->queued, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return work;
+}
+
+static struct work *find_work(struct worker *self)
+{
+	struct work *work;
+	int i, start;
+
+	if ((work = pop_work(self, false)))
+		return work;
+
+	start = self - workers;
+	for (i = 1; i < nr_workers; i++) {
+		if ((work = pop_work(&workers[(start + i) % nr_workers], true)))
+			return work;
+	}
+
+	return NULL;
+}
+
+static bool any_queued(void)
+{
+	for (int i = 0; i < nr_workers; i++) {
+		if (__atomic_load_n(&workers[i].queued, __ATOMIC_SEQ_CST))
+			return true;
+	}
+
+	return false;
+}
+
+static void ancestry_put(struct ancestry *anc)
+{
+	while (anc && __atomic_sub_fetch(&anc->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct ancestry *parent = anc->parent;
+
+		free(anc);
+		anc = parent;
+	}
+}
+
+static void dir_put(struct dir_ref *dir)
+{
+	if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(dir->fd);
+		free(dir);
+	}
+}
+
+static void queue_dir(struct worker *w, struct ancestry *parent, const char *path,
+		      const char *name)
+{
+	struct work *work = calloc(1, sizeof (*work));
+
+	if (!work || asprintf(&work->dir.path, "%s/%s", path, name) < 0) {
+		fprintf(stderr, "finder: %s/%s: %s\n", path, name, strerror(ENOMEM));
+		free(work);
+		return;
+	}
+
+	work->type = WORK_DIR;
+	work->dir.parent = parent;
+	__atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+	push_work(w, work);
+}
+
+static void queue_files(struct worker *w, struct work **chunk)
+{
+	if (*chunk) {
+		push_work(w, *chunk);
+		*chunk = NULL;
+	}
+}
+
+static void add_file(struct worker *w, struct dir_ref *dir, struct work **chunk,
+		     const char *name)
+{
+	size_t len = strlen(name) + 1;
+	struct work *work = *chunk;
+
+	if (work && (work->files.count == CHUNK_FILES ||
+		     work->files.used + len > CHUNK_NAMES))
+		queue_files(w, chunk);
+
+	if (!*chunk) {
+		work = calloc(1, sizeof (*work));
+		if (work)
+			work->files.names = malloc(len > CHUNK_NAMES ? len : CHUNK_NAMES);
+		if (!work || !work->files.names) {
+			fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(ENOMEM));
+			free(work);
+			return;
+		}
+
+		work->type = WORK_FILES;
+		work->files.dir = dir;
+		__atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+		*chunk = work;
+	}
+
+	memcpy(work->files.names + work->files.used, name, len);
+	work->files.used += len;
+	work->files.count++;
+}
+
+static void scan_dir(struct worker *w, struct work *work)
+{
+	const char *path = work->dir.path;
+	struct ancestry *anc, *a;
+	struct work *chunk = NULL;
+	struct dir_ref *dir;
+	struct stat st;
+	char dents[DENTS_SIZE];
+	long nread;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	for (a = work->dir.parent; a; a = a->parent) {
+		if (a->dev == st.st_dev && a->ino == st.st_ino) {
+			fprintf(stderr, "finder: File system loop detected; '%s' is part "
+				"of the same file system loop as an ancestor.\n", path);
+			close(fd);
+			return;
+		}
+	}
+
+	anc = malloc(sizeof (*anc));
+	dir = malloc(sizeof (*dir) + strlen(path) + 1);
+	if (!anc || !dir) {
+		fprintf(stderr, "finder: %s: %s\n", path, strerror(ENOMEM));
+		free(anc);
+		free(dir);
+		close(fd);
+		return;
+	}
+
+	anc->refs = 1;
+	anc->dev = st.st_dev;
+	anc->ino = st.st_ino;
+	anc->parent = work->dir.parent;
+	work->dir.parent = NULL;	/* the new node took our reference */
+	dir->refs = 1;
+	dir->fd = fd;
+	strcpy(dir->path, path);
+
+	while ((nread = syscall(SYS_getdents64, fd, dents, sizeof (dents))) > 0) {
+		for (long pos = 0; pos < nread;) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + pos);
+			unsigned char type = d->d_type;
+
+			pos += d->d_reclen;
+			if (d->d_name[0] == '.' && (!d->d_name[1] ||
+			    (d->d_name[1] == '.' && !d->d_name[2])))
+				continue;
+
+			/* like find -L, see through symbolic links */
+			if (type == DT_LNK || type == DT_UNKNOWN) {
+				if (fstatat(fd, d->d_name, &st, 0) < 0)
+					continue;
+				type = S_ISDIR(st.st_mode) ? DT_DIR :
+				       S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+
+			if (type == DT_DIR)
+				queue_dir(w, anc, path, d->d_name);
+			else if (type == DT_REG)
+				add_file(w, dir, &chunk, d->d_name);
+		}
+	}
+
+	if (nread < 0)
+		fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+
+	queue_files(w, &chunk);
+	dir_put(dir);
+	ancestry_put(anc);
+}
+
+/* first occurrence of the needle in [hay, hay + len) */
+static const char *search(const char *hay, size_t len)
+{
+	const char *end = hay + len;
+
+	if (len < needle_len)
+		return NULL;
+
+	if (needle_len == 1)
+		return memchr(hay, needle[0], len);
+
+#ifdef __SSE2__
+	{
+		/* compare the first and last needle bytes 16 positions at a time */
+		const __m128i first = _mm_set1_epi8(needle[0]);
+		const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+		for (; hay + needle_len - 1 + 16 <= end; hay += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)hay);
+			__m128i b = _mm_loadu_si128((const __m128i *)(hay + needle_len - 1));
+			unsigned int mask;
+
+			mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+							       _mm_cmpeq_epi8(b, last)));
+			while (mask) {
+				int bit = __builtin_ctz(mask);
+
+				if (!memcmp(hay + bit + 1, needle + 1, needle_len - 2))
+					return hay + bit;
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+	while ((size_t)(end - hay) >= needle_len) {
+		hay = memchr(hay, needle[0], end - hay - needle_len + 1);
+		if (!hay)
+			return NULL;
+		if (!memcmp(hay + 1, needle + 1, needle_len - 1))
+			return hay;
+		hay++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Count the lines holding the needle, a buffer at a time. Past the last
+ * match, only the last needle_len - 1 bytes of a line still going on can be
+ * part of a match, so that much is carried over into the next buffer.
+ */
+static unsigned long count_plain(struct worker *w, int fd, bool collect)
+{
+	unsigned long lines = 0;
+	bool in_match = false;
+	size_t carry = 0;
+	ssize_t nread;
+
+	for (;;) {
+		const char *p, *end, *hit, *nl;
+		size_t tail;
+
+		nread = read(fd, w->buf + carry, READ_SIZE);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread <= 0)
+			break;
+
+		if (collect)
+			index_collect_data(&w->index, w->buf + carry, nread);
+
+		p = w->buf;
+		end = w->buf + carry + nread;
+
+		/* the rest of an already matching line counts for nothing more */
+		if (in_match) {
+			if (!(nl = memchr(p, '\n', end - p)))
+				continue;
+			p = nl + 1;
+			in_match = false;
+		}
+
+		while ((hit = search(p, end - p))) {
+			lines++;
+			if (!(nl = memchr(hit + needle_len, '\n', end - hit - needle_len))) {
+				in_match = true;
+				break;
+			}
+			p = nl + 1;
+		}
+
+		carry = 0;
+		if (in_match)
+			continue;
+
+		tail = end - p < (ssize_t)needle_len - 1 ? (size_t)(end - p) : needle_len - 1;
+		if ((nl = memrchr(end - tail, '\n', tail)))
+			tail = end - nl - 1;
+		memmove(w->buf, end - tail, tail);
+		carry = tail;
+	}
+
+	return lines;
+}
+
+static unsigned long count_regex(struct worker *w, int fd, bool collect)
+{
+	unsigned long lines = 0;
+	size_t size = 0;
+	char *line = NULL;
+	ssize_t len;
+	FILE *f;
+
+	if (!(f = fdopen(fd, "r"))) {
+		close(fd);
+		return 0;
+	}
+
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (collect)
+			index_collect_data(&w->index, line, len);
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (!regexec(&regex, line, 0, NULL, 0))
+			lines++;
+	}
+
+	free(line);
+	fclose(f);
+
+	return lines;
+}
+
+static void scan_files(struct worker *w, struct work *work)
+{
+	struct dir_ref *dir = work->files.dir;
+	const char *name = work->files.names;
+
+	for (int i = 0; i < work->files.count; i++, name += strlen(name) + 1) {
+		bool collect = index_build;
+		struct stat st;
+		long id = -1;
+		int fd;
+
+		/* like find, a file is counted even when grep cannot read it */
+		w->files++;
+
+		if (index_map || index_build) {
+			if (fstatat(dir->fd, name, &st, 0) < 0) {
+				fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(errno));
+				continue;
+			}
+			if (index_map)
+				id = index_lookup(index_map, &st);
+		}
+
+		/* the index already knows this file as it is now */
+		if (id >= 0) {
+			if (index_build && index_collect_old(&w->index, &st, id) < 0)
+				fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(ENOMEM));
+			if (index_narrowed && !index_candidate(index_map, id))
+				continue;
+			collect = false;
+		}
+
+		fd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+		if (fd < 0) {
+			fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(errno));
+			continue;
+		}
+
+		if (collect && index_collect_new(&w->index, &st) < 0) {
+			fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(ENOMEM));
+			collect = false;
+		}
+
+		if (use_regex) {
+			w->lines += count_regex(w, fd, collect);
+		} else {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			w->lines += count_plain(w, fd, collect);
+			close(fd);
+		}
+
+		if (collect)
+			index_collect_end(&w->index);
+	}
+
+	dir_put(dir);
+	free(work->files.names);
+}
+
+static void *finder_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct work *work;
+
+	for (;;) {
+		if ((work = find_work(w))) {
+			if (work->type == WORK_DIR) {
+				scan_dir(w, work);
+				ancestry_put(work->dir.parent);
+				free(work->dir.path);
+			} else {
+				scan_files(w, work);
+			}
+			free(work);
+
+			if (__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST) == 0) {
+				pthread_mutex_lock(&idle_lock);
+				pthread_cond_broadcast(&idle_cond);
+				pthread_mutex_unlock(&idle_lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&idle_lock);
+		__atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) && !any_queued())
+			pthread_cond_wait(&idle_cond, &idle_lock);
+		__atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&idle_lock);
+
+		if (!__atomic_load_n(&pending, __ATOMIC_SEQ_CST))
+			break;
+	}
+
+	return NULL;
+}
+
+/* run by finder.sh, whose own usage is repeated word for word */
+static const char *script;
+
+static void usage(const char *prog)
+{
+	printf("ERROR: Illegal number of arguments\n");
+	printf("USE:\n");
+	if (script)
+		printf("    %s <FILES-DIR> <STRING-TO-SEARCH>\n", prog);
+	else
+		printf("    %s [-j threads] [--index] <FILES-DIR> <STRING-TO-SEARCH>\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{"index",	0, NULL, 'i'},
+		{"jobs",	1, NULL, 'j'},
+		{NULL,		0, NULL,  0}
+	};
+	unsigned long files = 0, lines = 0;
+	char *index_file = NULL;
+	struct work *root;
+	struct stat st;
+	int opt, i;
+
+	script = getenv("FINDER_SCRIPT");
+	if (script && *script)
+		argv[0] = (char *)script;
+	else
+		script = NULL;
+	unsetenv("FINDER_SCRIPT");
+
+	nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt_long(argc, argv, "j:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			index_build = true;
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	if (nr_workers < 1)
+		nr_workers = 1;
+	if (nr_workers > MAX_THREADS)
+		nr_workers = MAX_THREADS;
+
+	if (stat(argv[optind], &st) < 0 || !S_ISDIR(st.st_mode)) {
+		printf("ERROR: %s: Not a directory\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	needle = argv[optind + 1];
+	needle_len = strlen(needle);
+	if (!needle_len) {
+		printf("ERROR: Empty search string\n");
+		return EXIT_FAILURE;
+	}
+
+	/* grep takes a basic regular expression: only plain strings are searched for */
+	if (strpbrk(needle, REGEX_CHARS)) {
+		int rc = regcomp(&regex, needle, REG_NOSUB);
+
+		if (rc) {
+			char msg[256];
+
+			regerror(rc, &regex, msg, sizeof (msg));
+			fprintf(stderr, "finder: %s\n", msg);
+			return EXIT_FAILURE;
+		}
+		use_regex = true;
+	}
+
+	root = calloc(1, sizeof (*root));
+	if (!root || !(root->dir.path = strdup(argv[optind]))) {
+		fprintf(stderr, "finder: %s\n", strerror(ENOMEM));
+		return EXIT_FAILURE;
+	}
+	root->type = WORK_DIR;
+
+	/* an index made of something else, or a broken one, is no index at all */
+	if (index_path(argv[optind], &index_file)) {
+		index_map = index_open(index_file);
+		if (index_map && !use_regex)
+			index_narrowed = index_select(index_map, needle, needle_len);
+	} else if (index_build) {
+		fprintf(stderr, "finder: %s: cannot place its index\n", argv[optind]);
+		index_build = false;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].buf = malloc(READ_SIZE + needle_len);
+		if (!workers[i].buf || (index_build && index_collector_init(&workers[i].index) < 0)) {
+			fprintf(stderr, "finder: %s\n", strerror(ENOMEM));
+			return EXIT_FAILURE;
+		}
+	}
+
+	push_work(&workers[0], root);
+	for (i = 1; i < nr_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, finder_worker, &workers[i]) != 0) {
+			nr_workers = i;
+			break;
+		}
+	}
+	finder_worker(&workers[0]);
+
+	for (i = 0; i < nr_workers; i++) {
+		if (i)
+			pthread_join(workers[i].thread, NULL);
+		files += workers[i].files;
+		lines += workers[i].lines;
+	}
+
+	if (index_build) {
+		struct index_collector collectors[MAX_THREADS];
+		int rc;
+
+		for (i = 0; i < nr_workers; i++)
+			collectors[i] = workers[i].index;
+
+		rc = index_write(index_file, index_map, collectors, nr_workers);
+		if (rc < 0)
+			fprintf(stderr, "finder: %s: %s\n", index_file, strerror(-rc));
+	}
+
+	for (i = 0; i < MAX_THREADS; i++) {
+		if (index_build && workers[i].buf)
+			index_collector_free(&workers[i].index);
+		free(workers[i].buf);
+	}
+
+	index_close(index_map);
+	free(index_file);
+	if (use_regex)
+		regfree(&regex);
+
+	printf("The number of files are %lu and the number of matching lines are %lu\n",
+	       files, lines);
+
+	return EXIT_SUCCESS;
+}
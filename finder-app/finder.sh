@@ -1,6 +1,14 @@
 #!/bin/sh
 #
 
+# hand over to the native finder, when it was built alongside this script
+FINDER="$(dirname "$0")/finder"
+if [ -x "${FINDER}" ]; then
+    # so that argument errors name this script, as below
+    export FINDER_SCRIPT="$0"
+    exec "${FINDER}" "$@"
+fi
+
 FILESDIR=${1}
 SEARCHSTR=${2}
 
@@ -107,7 +107,7 @@ popd
 
 # TODO: Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
-FINDER_APP_FILES=(autorun-qemu.sh finder.sh finder-test.sh writer)
+FINDER_APP_FILES=(autorun-qemu.sh finder.sh finder-test.sh writer finder)
 for F in ${FINDER_APP_FILES[@]}; do
     cp ${FINDER_APP_DIR}/$F ${OUTDIR}/rootfs/home/
 done
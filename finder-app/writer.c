@@ -2,12 +2,445 @@
  * writer.c: re-implementation of assignment1 writer.sh
  * 	     as requested for assignment2.
  * Copyright (c) 2025, Rafael Aquini <raaquini@gmail.com>
+ *
+ * Besides writing one string to one file, writer --batch writes all the
+ * files listed in a manifest, read from a file or stdin, one per line as:
+ *
+ *	<path>\t<string>		the string and a new line, like writer does
+ *	<path>\t@<size>[:<pattern>]	size bytes (k, m or g suffixed) repeating
+ *					pattern, or "x" when there is none
+ *
+ * where a pattern can hold new lines and tabs as \n and \t, and \ as \\.
+ *
+ * Lines starting with '#' are skipped. Missing parent directories are made,
+ * files are preallocated with fallocate() and written by a pool of threads,
+ * bypassing the page cache with --direct where the filesystem allows it.
+ * Throughput is reported for the whole batch, and with -v for every file.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define MAX_THREADS	64
+#define QUEUE_SIZE	1024
+#define WRITE_SIZE	(1024 * 1024)
+#define DIRECT_ALIGN	4096
+
+struct write_job {
+	char *path;
+	const char *data;	/* string to write, or the pattern to repeat */
+	size_t data_len;
+	size_t size;		/* bytes to write */
+};
+
+struct batch_worker {
+	pthread_t thread;
+	char *buf;		/* WRITE_SIZE, aligned for O_DIRECT */
+	unsigned long files;
+	unsigned long errors;
+	unsigned long long bytes;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct write_job jobs[QUEUE_SIZE];
+	unsigned int head, count;
+	bool done;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static bool direct_io;
+static bool verbose;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void queue_put(struct write_job *job)
+{
+	pthread_mutex_lock(&queue.lock);
+	while (queue.count == QUEUE_SIZE)
+		pthread_cond_wait(&queue.not_full, &queue.lock);
+	queue.jobs[(queue.head + queue.count++) % QUEUE_SIZE] = *job;
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static bool queue_get(struct write_job *job)
+{
+	pthread_mutex_lock(&queue.lock);
+	while (!queue.count && !queue.done)
+		pthread_cond_wait(&queue.not_empty, &queue.lock);
+	if (!queue.count) {
+		pthread_mutex_unlock(&queue.lock);
+		return false;
+	}
+	*job = queue.jobs[queue.head];
+	queue.head = (queue.head + 1) % QUEUE_SIZE;
+	queue.count--;
+	pthread_cond_signal(&queue.not_full);
+	pthread_mutex_unlock(&queue.lock);
+
+	return true;
+}
+
+/* mkdir -p of everything up to the last component of path */
+static int make_parents(char *path)
+{
+	for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+static int open_output(struct write_job *job, bool *direct)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	int fd;
+
+	/* O_DIRECT only pays off for whole, aligned blocks */
+	*direct = direct_io && job->size >= DIRECT_ALIGN;
+	fd = open(job->path, flags | (*direct ? O_DIRECT : 0), 0644);
+	if (fd < 0 && errno == ENOENT && !make_parents(job->path))
+		fd = open(job->path, flags | (*direct ? O_DIRECT : 0), 0644);
+	if (fd < 0 && *direct && errno == EINVAL) {
+		*direct = false;
+		fd = open(job->path, flags, 0644);
+	}
+
+	return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t written = write(fd, buf, len);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+/* lay out len bytes of the pattern, starting phase bytes into it */
+static void fill_pattern(char *buf, size_t len, const char *data, size_t data_len,
+			 size_t phase)
+{
+	size_t n = 0;
+
+	/* one period, rotated by phase */
+	while (n < len && n < data_len) {
+		size_t off = (phase + n) % data_len;
+		size_t chunk = data_len - off;
+
+		if (chunk > data_len - n)
+			chunk = data_len - n;
+		if (chunk > len - n)
+			chunk = len - n;
+		memcpy(buf + n, data + off, chunk);
+		n += chunk;
+	}
+
+	/* which then only needs doubling up */
+	while (n < len) {
+		size_t chunk = n < len - n ? n : len - n;
+
+		memcpy(buf + n, buf, chunk);
+		n += chunk;
+	}
+}
+
+static int write_file(struct batch_worker *w, struct write_job *job)
+{
+	size_t pos = 0, filled = 0, phase = 0;
+	bool direct;
+	int fd, rc = 0;
+
+	fd = open_output(job, &direct);
+	if (fd < 0)
+		return -1;
+
+	/* one extent up front, instead of growing the file write by write */
+	if (job->size) {
+		if (fallocate(fd, 0, 0, job->size) < 0 &&
+		    errno != EOPNOTSUPP && errno != EINVAL) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	while (pos < job->size) {
+		size_t len = job->size - pos < WRITE_SIZE ? job->size - pos : WRITE_SIZE;
+
+		/* the unaligned tail goes through the page cache */
+		if (direct && len % DIRECT_ALIGN) {
+			len -= len % DIRECT_ALIGN;
+			if (!len) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+				direct = false;
+				len = job->size - pos;
+			}
+		}
+
+		/* a short pattern stays laid out from one write to the next */
+		if (len > filled || pos % job->data_len != phase) {
+			phase = pos % job->data_len;
+			fill_pattern(w->buf, len, job->data, job->data_len, phase);
+			filled = len;
+		}
+
+		if ((rc = write_all(fd, w->buf, len)) < 0)
+			break;
+		pos += len;
+	}
+
+	if (close(fd) < 0)
+		rc = -1;
+
+	return rc;
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch_worker *w = arg;
+	struct write_job job;
+
+	while (queue_get(&job)) {
+		double start = now();
+
+		if (write_file(w, &job) < 0) {
+			syslog(LOG_ERR, "ERROR: %s: %s\n", job.path, strerror(errno));
+			w->errors++;
+		} else {
+			double secs = now() - start;
+
+			w->files++;
+			w->bytes += job.size;
+			if (verbose)
+				printf("%s: %zu bytes in %.0fus, %.1f MB/s\n", job.path, job.size,
+				       secs * 1e6, secs > 0 ? job.size / secs / 1e6 : 0.0);
+		}
+		free(job.path);
+	}
+
+	return NULL;
+}
+
+static size_t parse_size(const char *str, char **end)
+{
+	size_t size = strtoull(str, end, 10);
+
+	switch (**end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		(*end)++;
+	}
+
+	return size;
+}
+
+static size_t unescape(char *str)
+{
+	char *in = str, *out = str;
+
+	for (; *in; in++) {
+		if (*in == '\\' && in[1]) {
+			in++;
+			*out++ = *in == 'n' ? '\n' : *in == 't' ? '\t' : *in;
+		} else {
+			*out++ = *in;
+		}
+	}
+	*out = '\0';
+
+	return out - str;
+}
+
+/* turn a manifest line into a job; the job owns the line afterwards */
+static int parse_job(char *line, struct write_job *job)
+{
+	char *tab = strchr(line, '\t'), *end;
+	size_t len;
+
+	if (!tab || tab == line)
+		return -1;
+
+	*tab = '\0';
+	job->path = line;
+	job->data = tab + 1;
+
+	if (*job->data != '@') {
+		/* like the single file mode, the string ends in a new line */
+		len = strlen(tab + 1);
+		tab[len + 1] = '\n';
+		job->data_len = job->size = len + 1;
+		return 0;
+	}
+
+	job->size = parse_size(job->data + 1, &end);
+	if (end == job->data + 1 || (*end && *end != ':'))
+		return -1;
+
+	if (*end == ':' && end[1]) {
+		job->data_len = unescape(end + 1);
+		job->data = end + 1;
+	} else {
+		job->data = "x";
+		job->data_len = 1;
+	}
+
+	return 0;
+}
+
+static int run_batch(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{"batch",	0, NULL, 'b'},
+		{"direct",	0, NULL, 'D'},
+		{"jobs",	1, NULL, 'j'},
+		{"verbose",	0, NULL, 'v'},
+		{NULL,		0, NULL,  0}
+	};
+	struct batch_worker workers[MAX_THREADS];
+	unsigned long files = 0, errors = 0, lineno = 0;
+	unsigned long long bytes = 0;
+	int nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	FILE *manifest = stdin;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	double start, secs;
+	int opt, i;
+
+	while ((opt = getopt_long(argc, argv, "bDj:v", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			break;
+		case 'D':
+			direct_io = true;
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			syslog(LOG_ERR, "usage: %s --batch [-j threads] [--direct] [-v] [manifest]\n",
+			       argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nr_workers < 1)
+		nr_workers = 1;
+	if (nr_workers > MAX_THREADS)
+		nr_workers = MAX_THREADS;
+
+	if (optind < argc && strcmp(argv[optind], "-")) {
+		manifest = fopen(argv[optind], "r");
+		if (!manifest) {
+			syslog(LOG_ERR, "ERROR: %s: %s\n", argv[optind], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	start = now();
+	for (i = 0; i < nr_workers; i++) {
+		memset(&workers[i], 0, sizeof (workers[i]));
+		if (posix_memalign((void **)&workers[i].buf, DIRECT_ALIGN, WRITE_SIZE) ||
+		    pthread_create(&workers[i].thread, NULL, batch_worker, &workers[i])) {
+			syslog(LOG_ERR, "ERROR: cannot start writer threads\n");
+			free(workers[i].buf);
+			if (!i)
+				return EXIT_FAILURE;
+			nr_workers = i;
+			break;
+		}
+	}
+
+	while ((len = getline(&line, &size, manifest)) > 0) {
+		struct write_job job;
+
+		lineno++;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len || line[0] == '#')
+			continue;
+
+		if (parse_job(line, &job) < 0) {
+			syslog(LOG_ERR, "ERROR: manifest line %lu: cannot parse\n", lineno);
+			errors++;
+			continue;
+		}
+
+		queue_put(&job);
+		line = NULL;
+		size = 0;
+	}
+	free(line);
+
+	pthread_mutex_lock(&queue.lock);
+	queue.done = true;
+	pthread_cond_broadcast(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		files += workers[i].files;
+		errors += workers[i].errors;
+		bytes += workers[i].bytes;
+		free(workers[i].buf);
+	}
+	secs = now() - start;
+
+	if (manifest != stdin)
+		fclose(manifest);
+
+	printf("Wrote %lu files, %llu bytes in %.3fs: %.0f files/s, %.1f MB/s",
+	       files, bytes, secs, secs > 0 ? files / secs : 0.0,
+	       secs > 0 ? bytes / secs / 1e6 : 0.0);
+	printf(errors ? ", %lu errors\n" : "\n", errors);
+	closelog();
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[])
 {
@@ -16,6 +449,9 @@ int main(int argc, char *argv[])
 
 	openlog(NULL, LOG_PERROR|LOG_PID, LOG_USER);
 
+	if (argc > 1 && !strcmp(argv[1], "--batch"))
+		return run_batch(argc, argv);
+
 	if (argc != 3) {
 		syslog(LOG_ERR, "ERROR: illegal number of arguments: %d/2\n", argc - 1);
 		return EXIT_FAILURE;
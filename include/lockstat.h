@@ -0,0 +1,395 @@
+/*
+ * lockstat.h: pthread mutexes which can account for themselves
+ *
+ * A struct lockstat_mutex is taken and released with lockstat_lock() and
+ * lockstat_unlock(). Every lockstat_lock() call site gets its own record of
+ * how many times it acquired the lock, how many of those found it taken,
+ * and log2 histograms of the time spent waiting for the lock and holding it.
+ *
+ * Nothing is recorded unless the LOCKSTAT environment variable is set when
+ * the first lock is taken: "1" dumps the statistics to stderr at exit, any
+ * other value but "0" names a file to append them to. LOCKSTAT_SPIN=<n> makes
+ * contended acquisitions spin for up to n attempts before parking on the
+ * mutex, adapting per lock to how long it actually takes to get it.
+ *
+ * Each thread counts into its own slab, so recording takes no lock and no
+ * atomic read-modify-write; the slab of a thread gone is handed over to the
+ * next new thread. All state is static, one instance per translation unit.
+ */
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LOCKSTAT_MAX_SITES	32
+#define LOCKSTAT_BUCKETS	32	/* [2^n, 2^n+1) ns, the last one open */
+
+struct lockstat_mutex {
+	pthread_mutex_t mutex;
+	const char *name;
+	int spin;			/* adaptive spin estimate */
+	uint64_t since;			/* owner only: when it got the lock */
+	struct lockstat_site *site;	/* owner only: where it got the lock */
+};
+
+#define LOCKSTAT_MUTEX_INITIALIZER(lockname)				\
+	{ PTHREAD_MUTEX_INITIALIZER, lockname, 0, 0, NULL }
+
+static inline void lockstat_mutex_init(struct lockstat_mutex *m, const char *name)
+{
+	pthread_mutex_init(&m->mutex, NULL);
+	m->name = name;
+	m->spin = 0;
+	m->site = NULL;
+}
+
+static inline void lockstat_mutex_destroy(struct lockstat_mutex *m)
+{
+	pthread_mutex_destroy(&m->mutex);
+}
+
+struct lockstat_site {
+	const char *file;
+	int line;
+	int index;			/* slot in each slab, -1 until used */
+	const char *name;		/* of the lock it first took */
+	struct lockstat_site *next;
+};
+
+struct lockstat_count {
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+	uint64_t wait[LOCKSTAT_BUCKETS];
+	uint64_t hold[LOCKSTAT_BUCKETS];
+};
+
+struct lockstat_slab {
+	bool in_use;
+	struct lockstat_slab *next;
+	struct lockstat_count count[LOCKSTAT_MAX_SITES];
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;		/* slow paths only */
+	pthread_key_t key;
+	bool enabled;
+	int max_spin;
+	const char *output;
+	int nr_sites;
+	struct lockstat_site *sites;
+	struct lockstat_slab *slabs;
+} lockstat = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER, 0, false, 0,
+	       NULL, 0, NULL, NULL };
+
+/*
+ * The owner is the only writer, so no read-modify-write is needed; the relaxed
+ * atomics only keep lockstat_dump() reading them concurrently well defined.
+ */
+#define lockstat_add(var, val)						\
+	__atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (val), \
+			 __ATOMIC_RELAXED)
+
+static inline uint64_t lockstat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int lockstat_bucket(uint64_t ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	return bucket < LOCKSTAT_BUCKETS ? bucket : LOCKSTAT_BUCKETS - 1;
+}
+
+static inline void lockstat_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline uint64_t lockstat_percentile(const uint64_t *hist, uint64_t total,
+					   int percent)
+{
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < LOCKSTAT_BUCKETS - 1; i++) {
+		seen += __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+		if (seen * 100 >= total * percent)
+			break;
+	}
+
+	return 2ULL << i;	/* upper bound of the bucket */
+}
+
+/*
+ * Counters of threads still taking locks are read as they are being updated:
+ * each one is sound, but they may not add up with each other. Only the atexit
+ * dump calls this, exact as long as the other threads are done by then.
+ */
+static void lockstat_dump(FILE *out)
+{
+	struct lockstat_site *site;
+	struct lockstat_slab *slab;
+
+	pthread_mutex_lock(&lockstat.lock);
+	fprintf(out, "%-28s %-20s %10s %10s %12s %10s %10s %12s %10s %10s\n",
+		"site", "lock", "acquired", "contended", "wait-total", "wait-p50",
+		"wait-p99", "hold-total", "hold-p50", "hold-p99");
+
+	for (site = lockstat.sites; site; site = site->next) {
+		struct lockstat_count sum;
+		char where[64];
+
+		memset(&sum, 0, sizeof (sum));
+		for (slab = lockstat.slabs; slab; slab = slab->next) {
+			struct lockstat_count *c = &slab->count[site->index];
+
+			sum.acquired += __atomic_load_n(&c->acquired, __ATOMIC_RELAXED);
+			sum.contended += __atomic_load_n(&c->contended, __ATOMIC_RELAXED);
+			sum.wait_ns += __atomic_load_n(&c->wait_ns, __ATOMIC_RELAXED);
+			sum.hold_ns += __atomic_load_n(&c->hold_ns, __ATOMIC_RELAXED);
+			for (int i = 0; i < LOCKSTAT_BUCKETS; i++) {
+				sum.wait[i] += __atomic_load_n(&c->wait[i], __ATOMIC_RELAXED);
+				sum.hold[i] += __atomic_load_n(&c->hold[i], __ATOMIC_RELAXED);
+			}
+		}
+
+		if (!sum.acquired)
+			continue;
+
+		snprintf(where, sizeof (where), "%s:%d", site->file, site->line);
+		fprintf(out, "%-28s %-20s %10llu %10llu %10.3fms %8lluns %8lluns %10.3fms %8lluns %8lluns\n",
+			where, site->name ? site->name : "?",
+			(unsigned long long)sum.acquired,
+			(unsigned long long)sum.contended,
+			sum.wait_ns / 1e6,
+			(unsigned long long)lockstat_percentile(sum.wait, sum.acquired, 50),
+			(unsigned long long)lockstat_percentile(sum.wait, sum.acquired, 99),
+			sum.hold_ns / 1e6,
+			(unsigned long long)lockstat_percentile(sum.hold, sum.acquired, 50),
+			(unsigned long long)lockstat_percentile(sum.hold, sum.acquired, 99));
+	}
+
+	if (lockstat.nr_sites > LOCKSTAT_MAX_SITES)
+		fprintf(out, "lockstat: %d sites not accounted for\n",
+			lockstat.nr_sites - LOCKSTAT_MAX_SITES);
+	pthread_mutex_unlock(&lockstat.lock);
+}
+
+static void lockstat_atexit(void)
+{
+	FILE *out = stderr;
+
+	if (strcmp(lockstat.output, "1") && !(out = fopen(lockstat.output, "a")))
+		return;
+
+	lockstat_dump(out);
+	if (out != stderr)
+		fclose(out);
+}
+
+static void lockstat_slab_release(void *arg)
+{
+	struct lockstat_slab *slab = arg;
+
+	__atomic_store_n(&slab->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void lockstat_init(void)
+{
+	const char *spin = getenv("LOCKSTAT_SPIN");
+
+	if (spin)
+		lockstat.max_spin = atoi(spin);
+
+	lockstat.output = getenv("LOCKSTAT");
+	if (!lockstat.output || !*lockstat.output || !strcmp(lockstat.output, "0"))
+		return;
+
+	if (pthread_key_create(&lockstat.key, lockstat_slab_release) != 0)
+		return;
+
+	lockstat.enabled = true;
+	atexit(lockstat_atexit);
+}
+
+/* this thread's slab: a free one if some thread left it, or a new one */
+static struct lockstat_slab *lockstat_slab(void)
+{
+	struct lockstat_slab *slab = pthread_getspecific(lockstat.key);
+	bool free_slab = false;
+
+	if (slab)
+		return slab;
+
+	pthread_mutex_lock(&lockstat.lock);
+	for (slab = lockstat.slabs; slab; slab = slab->next) {
+		if (__atomic_compare_exchange_n(&slab->in_use, &free_slab, true, false,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		free_slab = false;
+	}
+
+	if (!slab && (slab = calloc(1, sizeof (*slab)))) {
+		slab->in_use = true;
+		slab->next = lockstat.slabs;
+		lockstat.slabs = slab;
+	}
+	pthread_mutex_unlock(&lockstat.lock);
+
+	if (slab)
+		pthread_setspecific(lockstat.key, slab);
+
+	return slab;
+}
+
+static struct lockstat_count *lockstat_count(struct lockstat_site *site,
+					     struct lockstat_mutex *m)
+{
+	struct lockstat_slab *slab;
+	int index = __atomic_load_n(&site->index, __ATOMIC_ACQUIRE);
+
+	if (index < 0) {
+		pthread_mutex_lock(&lockstat.lock);
+		if ((index = site->index) < 0) {
+			index = lockstat.nr_sites++;
+			site->name = m->name;
+			if (index < LOCKSTAT_MAX_SITES) {
+				site->next = lockstat.sites;
+				lockstat.sites = site;
+			}
+			__atomic_store_n(&site->index, index, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&lockstat.lock);
+	}
+
+	if (index >= LOCKSTAT_MAX_SITES || !(slab = lockstat_slab()))
+		return NULL;
+
+	return &slab->count[index];
+}
+
+/* spin for at most twice the usual wait of this lock, then park on it */
+static inline bool lockstat_spin(struct lockstat_mutex *m)
+{
+	int spin = __atomic_load_n(&m->spin, __ATOMIC_RELAXED);
+	int limit = spin * 2 + 10;
+	int i;
+
+	if (limit > lockstat.max_spin)
+		limit = lockstat.max_spin;
+
+	for (i = 0; i < limit; i++) {
+		lockstat_cpu_relax();
+		if (pthread_mutex_trylock(&m->mutex) == 0) {
+			__atomic_store_n(&m->spin, spin + (i - spin) / 8, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+
+	__atomic_store_n(&m->spin, spin + (limit - spin) / 8, __ATOMIC_RELAXED);
+	return false;
+}
+
+static inline void __lockstat_lock(struct lockstat_mutex *m, struct lockstat_site *site)
+{
+	struct lockstat_count *c;
+	uint64_t start, now;
+
+	pthread_once(&lockstat.once, lockstat_init);
+
+	if (pthread_mutex_trylock(&m->mutex) == 0) {
+		if (lockstat.enabled && (c = lockstat_count(site, m))) {
+			m->since = lockstat_now();
+			m->site = site;
+			lockstat_add(c->acquired, 1);
+			lockstat_add(c->wait[0], 1);
+		}
+		return;
+	}
+
+	start = lockstat.enabled ? lockstat_now() : 0;
+	if (!lockstat.max_spin || !lockstat_spin(m))
+		pthread_mutex_lock(&m->mutex);
+
+	if (!lockstat.enabled || !(c = lockstat_count(site, m)))
+		return;
+
+	now = lockstat_now();
+	m->since = now;
+	m->site = site;
+	lockstat_add(c->acquired, 1);
+	lockstat_add(c->contended, 1);
+	lockstat_add(c->wait_ns, now - start);
+	lockstat_add(c->wait[lockstat_bucket(now - start)], 1);
+}
+
+/* account for the hold, if the lock was taken with statistics on */
+static inline void __lockstat_release(struct lockstat_mutex *m)
+{
+	struct lockstat_site *site = m->site;
+	struct lockstat_count *c;
+	uint64_t held;
+
+	if (!site)
+		return;
+
+	m->site = NULL;
+	if (!(c = lockstat_count(site, m)))
+		return;
+
+	held = lockstat_now() - m->since;
+	lockstat_add(c->hold_ns, held);
+	lockstat_add(c->hold[lockstat_bucket(held)], 1);
+}
+
+static inline void lockstat_unlock(struct lockstat_mutex *m)
+{
+	__lockstat_release(m);
+	pthread_mutex_unlock(&m->mutex);
+}
+
+/*
+ * Time asleep on the condition is not held time; the wake up starts a new
+ * hold, counted against the site which first took the lock.
+ */
+static inline int lockstat_cond_wait(pthread_cond_t *cond, struct lockstat_mutex *m)
+{
+	struct lockstat_site *site = m->site;
+	int rc;
+
+	__lockstat_release(m);
+	rc = pthread_cond_wait(cond, &m->mutex);
+	if (site) {
+		m->since = lockstat_now();
+		m->site = site;
+	}
+
+	return rc;
+}
+
+#define lockstat_lock(m)						\
+	do {								\
+		static struct lockstat_site __lockstat_site = {		\
+			__FILE__, __LINE__, -1, NULL, NULL		\
+		};							\
+		__lockstat_lock((m), &__lockstat_site);			\
+	} while (0)
+
+#endif /* _LOCKSTAT_H_ */
@@ -11,19 +11,26 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <time.h>
 
 #include "slist.h"
+#include "lockstat.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #define CONN_BACKLOG	512
+#define SUBSCRIBE_CMD	"AESDSOCKET_SUBSCRIBE"
+#define SUBSCRIBER_MAX_LAG	(16UL << 20)
+#define SUBSCRIBER_SEND_TIMEOUT	10
 #define ARRAY_SIZE(a)	((int)(sizeof (a) / sizeof (__typeof__(a[0]))))
 #define __maybe_unused __attribute__((unused))
 
-pthread_mutex_t log_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct lockstat_mutex log_write_mutex = LOCKSTAT_MUTEX_INITIALIZER("log_write_mutex");
 static unsigned long sequence = 0;
 static bool signal_exit = false;
 static bool do_work = false;
@@ -31,9 +38,43 @@ static int port = 9000;
 const char *prog_name;
 #ifdef USE_AESD_CHAR_DEVICE
 const char *file = "/dev/aesdchar";
+/* opened once at start up and shared by all requests, under log_write_mutex */
+static int device_fd = -1;
 #else
 const char *file = "/var/tmp/aesdsocketdata";
+/* the data file, open for appending for as long as the server runs */
+static FILE *data_stream;
+
+/*
+ * In-memory copy of the data file, so responses never read it back.
+ * Bytes below history_len are never written again: appends go past it, into
+ * a bigger buffer when this one is full, so a responder holding a reference
+ * can send its prefix without any lock while the history keeps growing.
+ */
+struct history_buf {
+	unsigned long refs;
+	size_t size;		/* bytes allocated for data */
+	char data[];
+};
+
+static struct history_buf *history;	/* protected by log_write_mutex */
+static size_t history_len;
+static pthread_cond_t history_cond = PTHREAD_COND_INITIALIZER;
 #endif
+
+/*
+ * Connections which sent SUBSCRIBE_CMD, and get every line appended from then
+ * on. In file mode what is still to be sent to each is just the history past
+ * its offset, so appends cost them nothing but a wakeup, however many there
+ * are; with the char device each one follows its own open file instead.
+ */
+struct subscriber {
+	int socket_fd;
+	SLIST_ENTRY(subscriber) list;
+};
+
+static SLIST_HEAD(, subscriber) subscribers =	/* under log_write_mutex */
+	SLIST_HEAD_INITIALIZER(subscribers);
 const char *short_opts = "hdp:f:";
 const struct option long_opts[] = {
 	{"help",	0, NULL, 'h'},
@@ -51,11 +92,20 @@ struct thread_desc {
 	SLIST_ENTRY(thread_desc) list;
 };
 
+#ifdef USE_AESD_CHAR_DEVICE
+int handle_request(int socket_fd, int dev_fd);
+#else
 int handle_request(int socket_fd, FILE *stream);
+#endif
 char *read_line(int fd);
 void *monitor_worker(void *arg);
 void *request_worker(void *arg);
 void write_timestamp(FILE *stream);
+#ifndef USE_AESD_CHAR_DEVICE
+static void history_load(FILE *stream);
+static void history_put(struct history_buf *buf);
+#endif
+static void unsubscribe_all(void);
 
 void print_usage(void)
 {
@@ -139,6 +189,18 @@ int main(int argc, char *argv[])
 
 	openlog(NULL, LOG_PID|LOG_PERROR, LOG_USER);
 
+#ifdef USE_AESD_CHAR_DEVICE
+	device_fd = open(file, O_RDWR | O_CLOEXEC);
+	if (device_fd < 0)
+		panic("open()", errno);
+#else
+	/* open/create the data file */
+	data_stream = fopen(file, "a+");
+	if (!data_stream)
+		panic("fopen()", errno);
+	history_load(data_stream);
+#endif
+
 	if (daemonize) {
 		/* ignore SIGHUP in daemon mode */
 		memset(&sa, 0, sizeof (sa));
@@ -225,16 +287,18 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
+		/* the worker may run before pthread_create() even returns */
+		client->data[0] = (void *)file;
+		client->data[1] = (void *)(unsigned long)request_fd;
+		client->done = false;
 		rc = pthread_create(&client->id, NULL, request_worker, client);
 		if (rc != 0) {
 			warn("pthread_create()", errno);
+			close(request_fd);
 			free(client);
 			continue;
 		}
 
-		client->data[0] = (void *)file;
-		client->data[1] = (void *)(unsigned long)request_fd;
-		client->done = false;
 		SLIST_INSERT_HEAD(&threads, client, list);
 signal_out:
 		if (signal_exit) {
@@ -248,6 +312,7 @@ signal_out:
 	 * of the server loop.
 	 * So, we gracefully wrap up and terminate the main program.
 	 */
+	unsubscribe_all();
 	while (!SLIST_EMPTY(&threads)) {
 		struct thread_desc *t, *tmp;
 
@@ -265,25 +330,120 @@ signal_out:
 
 	shutdown(socket_fd, SHUT_RDWR);
 	close(socket_fd);
-#ifndef USE_AESD_CHAR_DEVICE
+#ifdef USE_AESD_CHAR_DEVICE
+	close(device_fd);
+#else
+	fclose(data_stream);
 	unlink(file);
+	history_put(history);
 #endif
 	closelog();
 
 	return 0;
 }
 
+#ifndef USE_AESD_CHAR_DEVICE
+static void history_put(struct history_buf *buf)
+{
+	if (buf && __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(buf);
+}
+
+/* take a reference to the history as it is now, with log_write_mutex held */
+static struct history_buf *history_get(size_t *len)
+{
+	*len = history_len;
+	if (history)
+		__atomic_add_fetch(&history->refs, 1, __ATOMIC_RELAXED);
+
+	return history;
+}
+
+/* add len bytes to the in-memory history, with log_write_mutex held */
+static void history_extend(const char *buf, size_t len)
+{
+	if (!history || history_len + len > history->size) {
+		size_t size = history ? history->size * 2 : 4096;
+		struct history_buf *nbuf;
+
+		while (size < history_len + len)
+			size *= 2;
+
+		nbuf = malloc(sizeof (*nbuf) + size);
+		if (!nbuf)
+			panic("malloc()", errno);
+
+		nbuf->refs = 1;
+		nbuf->size = size;
+		if (history)
+			memcpy(nbuf->data, history->data, history_len);
+
+		/* responders still sending from the old buffer keep it alive */
+		history_put(history);
+		history = nbuf;
+	}
+
+	memcpy(history->data + history_len, buf, len);
+	history_len += len;
+}
+
+/* append to both the data file and the history, with log_write_mutex held */
+static void history_append(FILE *stream, const char *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, stream) != len || fflush(stream))
+		panic("fwrite()", errno);
+
+	history_extend(buf, len);
+	if (!SLIST_EMPTY(&subscribers))
+		pthread_cond_broadcast(&history_cond);
+}
+
+/* pick up whatever a previous run left in the data file */
+static void history_load(FILE *stream)
+{
+	char buf[4096];
+	size_t nread;
+
+	rewind(stream);
+	while ((nread = fread(buf, 1, sizeof (buf), stream)) > 0)
+		history_extend(buf, nread);
+
+	if (ferror(stream))
+		panic("fread()", errno);
+}
+#endif
+
+/* wake all subscribers up to leave, as the server is going down */
+static void unsubscribe_all(void)
+{
+	struct subscriber *sub;
+
+	lockstat_lock(&log_write_mutex);
+	SLIST_FOREACH(sub, &subscribers, list)
+		shutdown(sub->socket_fd, SHUT_RDWR);
+#ifndef USE_AESD_CHAR_DEVICE
+	pthread_cond_broadcast(&history_cond);
+#endif
+	lockstat_unlock(&log_write_mutex);
+}
+
 void write_timestamp(FILE *stream)
 {
 	char str[512];
 	struct tm *tm_info;
 	time_t t;
+	int len;
 
 	time(&t);
 	tm_info = localtime(&t);
-	strftime(str, sizeof (str), "timestamp: %a, %d %b %Y %T %z", tm_info);
-	fprintf(stream, "%s\n", str);
+	len = strftime(str, sizeof (str) - 1, "timestamp: %a, %d %b %Y %T %z", tm_info);
+	str[len++] = '\n';
+#ifdef USE_AESD_CHAR_DEVICE
+	fwrite(str, 1, len, stream);
 	fflush(stream);
+#else
+	history_append(stream, str, len);
+#endif
 }
 
 void *monitor_worker(void *arg)
@@ -302,16 +462,9 @@ void *monitor_worker(void *arg)
 		/* janitorial work here */
 #ifndef USE_AESD_CHAR_DEVICE
 		if (!(sequence % 10)) {
-			char *file = desc->data[0];
-			FILE *stream;
-			/* open/create the data file */
-			stream = fopen(file, "a+");
-			if (!stream)
-				panic("fopen()", errno);
-			pthread_mutex_lock(&log_write_mutex);
-			write_timestamp(stream);
-			pthread_mutex_unlock(&log_write_mutex);
-			fclose(stream);
+			lockstat_lock(&log_write_mutex);
+			write_timestamp(data_stream);
+			lockstat_unlock(&log_write_mutex);
 		}
 #endif
 	}
@@ -324,109 +477,329 @@ void *monitor_worker(void *arg)
 void *request_worker(void *arg)
 {
 	struct thread_desc *desc = arg;
-	char *file = desc->data[0];
 	int rc, socket_fd = (unsigned long)desc->data[1];
-	FILE *stream;
 
-	/* open/create the data file */
-	stream = fopen(file, "a+");
-	if (!stream)
-		panic("fopen()", errno);
-
-	rc = handle_request(socket_fd, stream);
+#ifdef USE_AESD_CHAR_DEVICE
+	rc = handle_request(socket_fd, device_fd);
 	if (rc < 0)
 		warn("handle_request", errno);
+#else
+	rc = handle_request(socket_fd, data_stream);
+	if (rc < 0)
+		warn("handle_request", errno);
+#endif
 
 	shutdown(socket_fd, SHUT_RDWR);
 	close(socket_fd);
-	fclose(stream);
 
 	desc->done = true;
 
 	return NULL;
 }
 
-void echo(int socket_fd, FILE *stream)
+static void write_all(int socket_fd, const char *buf, ssize_t len)
 {
-	char *line = NULL;
-	size_t len = 0;
+	ssize_t nwrite = 0;
+
+	for (ssize_t written = 0; written < len; written += nwrite) {
+		nwrite = write(socket_fd, buf+written, len-written);
+		if (nwrite < 0 && errno == EINTR)
+			nwrite = 0;
+		else if (nwrite < 0)
+			panic("write()", errno);
+	}
+}
+
+/* get a request line from the socket, logging who sent it */
+static char *accept_request(int socket_fd, struct sockaddr_in *peer_addr)
+{
+	socklen_t socket_len = sizeof (*peer_addr);
+
+	memset(peer_addr, 0, sizeof (*peer_addr));
+	if (getpeername(socket_fd, (struct sockaddr *)peer_addr, &socket_len) < 0)
+		return NULL;
+
+	syslog(LOG_INFO, "Accepted connection from %s",
+			inet_ntoa(peer_addr->sin_addr));
+
+	return read_line(socket_fd);
+}
+
+/* like write_all(), but a subscriber going away is no reason to panic */
+static int send_all(int socket_fd, const char *buf, size_t len)
+{
+	ssize_t nsent;
+
+	while (len > 0) {
+		nsent = send(socket_fd, buf, len, MSG_NOSIGNAL);
+		if (nsent < 0 && errno == EINTR)
+			continue;
+		else if (nsent < 0)
+			return -1;
+
+		buf += nsent;
+		len -= nsent;
+	}
+
+	return 0;
+}
+
+/* ready a subscriber's thread and socket for a long, possibly stuck, stay */
+static void subscriber_setup(int socket_fd)
+{
+	struct timeval timeout = { .tv_sec = SUBSCRIBER_SEND_TIMEOUT };
+	sigset_t mask;
+
+	/* leave signals to the main thread, as this one may sleep for long */
+	sigemptyset(&mask);
+	for (int i = 0; i < ARRAY_SIZE(term_signals); i++)
+		sigaddset(&mask, term_signals[i]);
+	sigaddset(&mask, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	if (setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout)) < 0)
+		warn("setsockopt()", errno);
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+/*
+ * Send the device contents from offset onwards. Every read returns at most
+ * one command, so the buffer is kept around and only sized for large ones.
+ */
+void echo(int socket_fd, int dev_fd, off_t offset)
+{
+	static char buf[65536];
 	ssize_t nread;
 
-	while ((nread = getline(&line, &len, stream)) != -1) {
-		ssize_t nwrite = 0;
+	while ((nread = pread(dev_fd, buf, sizeof (buf), offset)) != 0) {
+		if (nread < 0 && errno == EINTR)
+			continue;
+		else if (nread < 0)
+			panic("pread()", errno);
 
-		for (ssize_t written = 0; written < nread; written += nwrite) {
-			nwrite = write(socket_fd, line+written, nread-written);
-			if (nwrite < 0 && errno == EINTR)
-				continue;
-			else if (nwrite < 0)
-				panic("write()", errno);
-		}
+		write_all(socket_fd, buf, nread);
+		offset += nread;
+	}
+}
+
+/*
+ * Send everything the device holds, then keep pushing whatever gets written
+ * until the peer goes away, lags too far behind, or the server exits. Each
+ * subscriber reads through an open file of its own, in the driver's follow
+ * mode, so it takes no lock from writers. Falling out of the device's window
+ * would lose commands, which drops the subscriber just as lagging does.
+ */
+static void subscribe(int socket_fd)
+{
+	struct subscriber sub = { .socket_fd = socket_fd };
+	struct aesd_index index;
+	struct pollfd pfds[2];
+	uint32_t follow = 1;
+	uint64_t pos;
+	char buf[65536];
+	ssize_t nread;
+	int dev_fd;
+
+	dev_fd = open(file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (dev_fd < 0) {
+		warn("open()", errno);
+		return;
 	}
 
-	free(line);
+	/* file offset 0 stands for index.start from now on */
+	if (ioctl(dev_fd, AESDCHAR_IOCFOLLOW, &follow) < 0 ||
+	    ioctl(dev_fd, AESDCHAR_IOCGETINDEX, &index) < 0) {
+		warn("ioctl()", errno);
+		goto out;
+	}
+	pos = index.start;
+
+	subscriber_setup(socket_fd);
+
+	lockstat_lock(&log_write_mutex);
+	SLIST_INSERT_HEAD(&subscribers, &sub, list);
+	lockstat_unlock(&log_write_mutex);
+
+	pfds[0].fd = dev_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = socket_fd;
+	pfds[1].events = POLLIN;
+	while (!signal_exit) {
+		if (ioctl(dev_fd, AESDCHAR_IOCGETINDEX, &index) < 0) {
+			warn("ioctl()", errno);
+			break;
+		}
+
+		if (pos < index.start || index.start + index.size - pos > SUBSCRIBER_MAX_LAG) {
+			syslog(LOG_INFO, "Dropping subscriber %d, %llu bytes behind",
+				socket_fd, (unsigned long long)(index.start + index.size - pos));
+			break;
+		}
+
+		nread = read(dev_fd, buf, sizeof (buf));
+		if (nread > 0) {
+			if (send_all(socket_fd, buf, nread) < 0)
+				break;
+			pos += nread;
+			continue;
+		} else if (nread < 0 && errno == EINTR) {
+			continue;
+		} else if (nread < 0 && errno != EAGAIN) {
+			warn("read()", errno);
+			break;
+		}
+
+		/* caught up: wait for a new command, or for the peer to go away */
+		while (poll(pfds, ARRAY_SIZE(pfds), -1) < 0) {
+			if (errno != EINTR) {
+				warn("poll()", errno);
+				goto out_unsubscribe;
+			}
+		}
+
+		/* a subscriber has nothing more to say: this is its hang up */
+		if (pfds[1].revents)
+			break;
+	}
+out_unsubscribe:
+	lockstat_lock(&log_write_mutex);
+	SLIST_REMOVE(&subscribers, &sub, subscriber, list);
+	lockstat_unlock(&log_write_mutex);
+out:
+	close(dev_fd);
 }
 
-int handle_request(int socket_fd, FILE *stream)
+int handle_request(int socket_fd, int dev_fd)
 {
 	struct sockaddr_in peer_addr;
-	socklen_t socket_len = 0;
-	char *line = NULL;
-	struct aesd_seekto seekto __maybe_unused;
+	struct aesd_seekto seekto;
+	struct iovec iov[2];
+	off_t offset = 0;
+	char *line;
 
-	memset(&peer_addr, 0, sizeof (peer_addr));
-	if (getpeername(socket_fd, (struct sockaddr *)&peer_addr, &socket_len) < 0)
+	if ((line = accept_request(socket_fd, &peer_addr)) == NULL)
 		return EXIT_FAILURE;
 
-	syslog(LOG_INFO, "Accepted connection from %s",
-			inet_ntoa(peer_addr.sin_addr));
-
-	/* get a line from the socket */
-	if ((line = read_line(socket_fd)) == NULL)
-		return EXIT_FAILURE;
+	if (!strcmp(line, SUBSCRIBE_CMD)) {
+		free(line);
+		subscribe(socket_fd);
+		goto closed;
+	}
 
-	pthread_mutex_lock(&log_write_mutex);
-#ifdef USE_AESD_CHAR_DEVICE
+	lockstat_lock(&log_write_mutex);
 	/* parse AESDCHAR_IOCSEEKTO:n,n */
 	if (sscanf(line, "AESDCHAR_IOCSEEKTO:%u,%u\n", &seekto.write_cmd,
 	    &seekto.write_cmd_offset) == 2) {
-		int fd, offset;
-
-		fseek(stream, 0, SEEK_SET);
 		syslog(LOG_INFO, "received AESDCHAR_IOCSEEKTO:%u,%u",
 			seekto.write_cmd, seekto.write_cmd_offset);
 
-		if ((fd = fileno(stream)) < 0)
-			panic("fileno()", errno);
-
-		if ((offset = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto)) < 0)
-			panic("ioctl()", errno);
+		/* the ioctl hands back the offset it seeked to */
+		if ((offset = ioctl(dev_fd, AESDCHAR_IOCSEEKTO, &seekto)) < 0) {
+			warn("ioctl()", errno);
+			goto out;
+		}
+	} else {
+		/* the whole packet goes in at once, as a single command */
+		iov[0].iov_base = line;
+		iov[0].iov_len = strlen(line);
+		iov[1].iov_base = "\n";
+		iov[1].iov_len = 1;
+		if (writev(dev_fd, iov, ARRAY_SIZE(iov)) < 0)
+			panic("writev()", errno);
+	}
 
-		free(line);
-		echo(socket_fd, stream);
-		pthread_mutex_unlock(&log_write_mutex);
-		syslog(LOG_INFO, "Closed connection from %s",
+	echo(socket_fd, dev_fd, offset);
+out:
+	lockstat_unlock(&log_write_mutex);
+	free(line);
+closed:
+	syslog(LOG_INFO, "Closed connection from %s",
 			inet_ntoa(peer_addr.sin_addr));
 
-		return EXIT_SUCCESS;
+	return EXIT_SUCCESS;
+}
+#else
+/*
+ * Send the whole history, then keep pushing whatever gets appended until the
+ * peer goes away, lags too far behind, or the server exits. A peer not reading
+ * for SUBSCRIBER_SEND_TIMEOUT seconds is dropped too, so that it cannot keep
+ * an old history buffer alive forever.
+ */
+static void subscribe(int socket_fd)
+{
+	struct subscriber sub = { .socket_fd = socket_fd };
+	struct history_buf *snapshot;
+	size_t sent = 0, len;
+	int rc;
+
+	subscriber_setup(socket_fd);
+
+	lockstat_lock(&log_write_mutex);
+	SLIST_INSERT_HEAD(&subscribers, &sub, list);
+	for (;;) {
+		while (sent == history_len && !signal_exit)
+			lockstat_cond_wait(&history_cond, &log_write_mutex);
+
+		if (signal_exit)
+			break;
+
+		if (sent && history_len - sent > SUBSCRIBER_MAX_LAG) {
+			syslog(LOG_INFO, "Dropping subscriber %d, %zu bytes behind",
+				socket_fd, history_len - sent);
+			break;
+		}
+
+		snapshot = history_get(&len);
+		lockstat_unlock(&log_write_mutex);
+
+		rc = send_all(socket_fd, snapshot->data + sent, len - sent);
+		history_put(snapshot);
+
+		lockstat_lock(&log_write_mutex);
+		if (rc < 0)
+			break;
+
+		sent = len;
+	}
+	SLIST_REMOVE(&subscribers, &sub, subscriber, list);
+	lockstat_unlock(&log_write_mutex);
+}
+
+int handle_request(int socket_fd, FILE *stream)
+{
+	struct sockaddr_in peer_addr;
+	struct history_buf *snapshot;
+	size_t len;
+	char *line;
+
+	if ((line = accept_request(socket_fd, &peer_addr)) == NULL)
+		return EXIT_FAILURE;
+
+	if (!strcmp(line, SUBSCRIBE_CMD)) {
+		free(line);
+		subscribe(socket_fd);
+		goto out;
 	}
-#endif
 
 	/* write line gotten from the socket into the file */
-	fprintf(stream, "%s\n", line);
-	fflush(stream);
+	len = strlen(line);
+	line[len++] = '\n';
+	lockstat_lock(&log_write_mutex);
+	history_append(stream, line, len);
+	snapshot = history_get(&len);
+	lockstat_unlock(&log_write_mutex);
 	free(line);
 
-	/* echo the whole file back to the socket */
-	fseek(stream, 0, SEEK_SET);
-	echo(socket_fd, stream);
-	pthread_mutex_unlock(&log_write_mutex);
-
+	/* echo the whole file back to the socket, as of our own append */
+	write_all(socket_fd, snapshot->data, len);
+	history_put(snapshot);
+out:
 	syslog(LOG_INFO, "Closed connection from %s",
 			inet_ntoa(peer_addr.sin_addr));
 
 	return EXIT_SUCCESS;
 }
+#endif
 
 char *read_line(int fd)
 {